@@ -0,0 +1,475 @@
+// Benchmarks.
+//
+//   g++ -O2 -std=c++11 bench.cpp -o bench -lei -pthread && ./bench [name...]
+//
+// "corpora" encodes and decodes generated terms of a few typical shapes,
+// each one with eipp and with the same term written out by hand with plain
+// ei_* calls, which shows what the wrappers cost. Throughput counts encoded
+// bytes; "new/term" counts calls to operator new per term (malloc, which
+// the encode buffers use, is not counted); peak RSS is for the whole
+// process so far.
+//
+// "compression" (build with -DEIPP_WITH_ZLIB and -lz) shows how much CPU
+// term compression costs against the bytes it saves. Compression pays off
+// when the link is slower than the "break-even" column: below that
+// bandwidth the saved transfer time exceeds the extra encode + decode time.
+//
+// Without arguments everything runs; otherwise only the named corpora or
+// sections, e.g. ./bench people map.
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <list>
+#include <map>
+#include <string>
+#include <tuple>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include "eipp.h"
+
+#ifdef EIPP_POSIX
+#include <sys/resource.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<size_t> allocations(0);
+
+// kept out of line, or GCC mistakes the free() for a mismatched deallocation
+#ifdef __GNUC__
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+struct Measure {
+    double seconds;         // per run
+    double allocations;     // operator new calls per run
+};
+
+template <typename F>
+Measure measure(F func) {
+    // repeat until the measurement is long enough to be meaningful
+    size_t runs = 1;
+    while(true) {
+        size_t before = allocations.load(std::memory_order_relaxed);
+        auto start = Clock::now();
+        for(size_t i = 0; i < runs; i++) {
+            func();
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        if(elapsed > 0.2) {
+            size_t calls = allocations.load(std::memory_order_relaxed) - before;
+            return Measure{elapsed / runs, (double)calls / runs};
+        }
+        runs *= 2;
+    }
+}
+
+template <typename F>
+double seconds_per_run(F func) {
+    return measure(func).seconds;
+}
+
+static size_t peak_rss_kb() {
+#ifdef EIPP_POSIX
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return (size_t)usage.ru_maxrss / 1024;
+#else
+        return (size_t)usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+static bool selected(int argc, char** argv, const char* name) {
+    if(argc < 2) return true;
+    for(int i = 1; i < argc; i++) {
+        if(std::string(argv[i]) == name) return true;
+    }
+    return false;
+}
+
+
+// --- corpora -----------------------------------------------------------------
+
+typedef std::tuple<int, std::string, std::list<eipp::Atom>> Person_t;
+typedef std::tuple<eipp::Atom, eipp::Atom, long> Event_t;
+
+static void print_row(const char* op, const Measure& m, size_t bytes, size_t terms) {
+    double mb_per_s = (double)bytes / m.seconds / 1e6;
+    double terms_per_s = (double)terms / m.seconds;
+    std::cout << "  " << std::left << std::setw(14) << op
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << mb_per_s
+              << std::setw(14) << std::setprecision(0) << terms_per_s
+              << std::setw(12) << std::setprecision(2) << m.allocations / (double)terms << std::endl;
+}
+
+// `value` is encoded and decoded as one message holding `terms` terms of
+// interest, e.g. the elements of a list. `raw_encode(x, value)` and
+// `raw_decode(buf, index, value)` are the same with plain ei.
+template <typename T, typename RawEncode, typename RawDecode>
+void bench_corpus(const char* name, const T& value, size_t terms, RawEncode raw_encode, RawDecode raw_decode) {
+    eipp::EIEncoder en;
+    en.encode(value);
+    std::string data = en.get_data();
+
+    ei_x_buff x;
+    ei_x_new_with_version(&x);
+    raw_encode(&x, value);
+    if(std::string(x.buff, (size_t)x.index) != data) {
+        std::cout << name << ": ei and eipp encode differently, skipped" << std::endl;
+        ei_x_free(&x);
+        return;
+    }
+
+    std::cout << name << ", " << data.size() << " bytes, " << terms << " terms" << std::endl;
+    std::cout << "  " << std::left << std::setw(14) << "op"
+              << std::right << std::setw(10) << "MB/s"
+              << std::setw(14) << "terms/s"
+              << std::setw(12) << "new/term" << std::endl;
+
+    print_row("eipp encode", measure([&]() {
+        en.reset();
+        en.encode(value);
+    }), data.size(), terms);
+
+    print_row("ei encode", measure([&]() {
+        x.index = 0;
+        ei_x_encode_version(&x);
+        raw_encode(&x, value);
+    }), data.size(), terms);
+
+    print_row("eipp decode", measure([&]() {
+        eipp::EIDecoder decoder(data.data(), data.size());
+        T result = decoder.decode<T>();
+        (void)result;
+    }), data.size(), terms);
+
+    print_row("ei decode", measure([&]() {
+        T result;
+        int index = 0, version = 0;
+        ei_decode_version(data.data(), &index, &version);
+        raw_decode(data.data(), &index, result);
+    }), data.size(), terms);
+
+    std::cout << "  peak RSS " << peak_rss_kb() << " kB" << std::endl << std::endl;
+    ei_x_free(&x);
+}
+
+// a list with its tail, the way ei needs it walked
+template <typename F>
+static void raw_decode_list(const char* buf, int* index, F element) {
+    int arity = 0;
+    ei_decode_list_header(buf, index, &arity);
+    if(arity == 0) return;
+    for(int i = 0; i < arity; i++) {
+        element();
+    }
+    ei_decode_list_header(buf, index, &arity);
+}
+
+static std::string raw_decode_string(const char* buf, int* index) {
+    int type = 0, size = 0;
+    ei_get_type(buf, index, &type, &size);
+    if(type == ERL_NIL_EXT) {
+        ei_decode_list_header(buf, index, &size);
+        return std::string();
+    }
+
+    std::string s((size_t)size + 1, '\0');
+    ei_decode_string(buf, index, &s[0]);
+    s.resize((size_t)size);
+    return s;
+}
+
+static eipp::Atom raw_decode_atom(const char* buf, int* index) {
+    char atom[MAXATOMLEN];
+    ei_decode_atom(buf, index, atom);
+    return eipp::Atom(atom);
+}
+
+static void bench_ints(size_t n) {
+    std::vector<long> value(n);
+    for(size_t i = 0; i < n; i++) value[i] = (long)(i * 7919) - 40000000;
+
+    std::string name = "ints x" + std::to_string(n);
+    bench_corpus(name.c_str(), value, n,
+        [](ei_x_buff* x, const std::vector<long>& v) {
+            ei_x_encode_list_header(x, (long)v.size());
+            for(long e: v) ei_x_encode_long(x, e);
+            ei_x_encode_empty_list(x);
+        },
+        [](const char* buf, int* index, std::vector<long>& v) {
+            raw_decode_list(buf, index, [&]() {
+                long e = 0;
+                ei_decode_long(buf, index, &e);
+                v.push_back(e);
+            });
+        });
+}
+
+static void bench_people(size_t n) {
+    static const char* names[] = {"Jim", "Tom", "David", "Alexandra", "Maximilian"};
+    static const char* tags[] = {"admin", "staff", "guest", "remote", "contractor"};
+
+    std::vector<Person_t> value;
+    for(size_t i = 0; i < n; i++) {
+        std::list<eipp::Atom> atoms;
+        for(size_t k = 0; k <= i % 3; k++) atoms.push_back(eipp::Atom(tags[(i + k) % 5]));
+        value.push_back(std::make_tuple((int)i, std::string(names[i % 5]) + std::to_string(i), atoms));
+    }
+
+    std::string name = "people x" + std::to_string(n);
+    bench_corpus(name.c_str(), value, n,
+        [](ei_x_buff* x, const std::vector<Person_t>& v) {
+            ei_x_encode_list_header(x, (long)v.size());
+            for(auto& p: v) {
+                ei_x_encode_tuple_header(x, 3);
+                ei_x_encode_long(x, std::get<0>(p));
+                ei_x_encode_string_len(x, std::get<1>(p).data(), (int)std::get<1>(p).size());
+                ei_x_encode_list_header(x, (long)std::get<2>(p).size());
+                for(auto& atom: std::get<2>(p)) {
+                    ei_x_encode_atom_len(x, atom.get_value().data(), (int)atom.get_value().size());
+                }
+                ei_x_encode_empty_list(x);
+            }
+            ei_x_encode_empty_list(x);
+        },
+        [](const char* buf, int* index, std::vector<Person_t>& v) {
+            raw_decode_list(buf, index, [&]() {
+                int arity = 0;
+                long id = 0;
+                Person_t p;
+                ei_decode_tuple_header(buf, index, &arity);
+                ei_decode_long(buf, index, &id);
+                std::get<0>(p) = (int)id;
+                std::get<1>(p) = raw_decode_string(buf, index);
+                raw_decode_list(buf, index, [&]() {
+                    std::get<2>(p).push_back(raw_decode_atom(buf, index));
+                });
+                v.push_back(std::move(p));
+            });
+        });
+}
+
+static void bench_blobs(size_t n, size_t size) {
+    std::vector<eipp::Binary> value;
+    for(size_t i = 0; i < n; i++) {
+        value.push_back(eipp::Binary(std::string(size, (char)('a' + i % 26))));
+    }
+
+    std::string name = "binaries " + std::to_string(n) + " x " + std::to_string(size / 1024) + "kB";
+    bench_corpus(name.c_str(), value, n,
+        [](ei_x_buff* x, const std::vector<eipp::Binary>& v) {
+            ei_x_encode_list_header(x, (long)v.size());
+            for(auto& b: v) ei_x_encode_binary(x, b.get_value().data(), (int)b.get_value().size());
+            ei_x_encode_empty_list(x);
+        },
+        [](const char* buf, int* index, std::vector<eipp::Binary>& v) {
+            raw_decode_list(buf, index, [&]() {
+                int type = 0, size = 0;
+                long len = 0;
+                ei_get_type(buf, index, &type, &size);
+                std::string s((size_t)size, '\0');
+                ei_decode_binary(buf, index, &s[0], &len);
+                v.push_back(eipp::Binary(s));
+            });
+        });
+}
+
+static void bench_map(size_t n) {
+    std::map<std::string, long> value;
+    for(size_t i = 0; i < n; i++) value["key_" + std::to_string(i * 31)] = (long)i;
+
+    std::string name = "map x" + std::to_string(n);
+    bench_corpus(name.c_str(), value, n,
+        [](ei_x_buff* x, const std::map<std::string, long>& v) {
+            ei_x_encode_map_header(x, (long)v.size());
+            for(auto& kv: v) {
+                ei_x_encode_string_len(x, kv.first.data(), (int)kv.first.size());
+                ei_x_encode_long(x, kv.second);
+            }
+        },
+        [](const char* buf, int* index, std::map<std::string, long>& v) {
+            int arity = 0;
+            ei_decode_map_header(buf, index, &arity);
+            for(int i = 0; i < arity; i++) {
+                std::string key = raw_decode_string(buf, index);
+                long e = 0;
+                ei_decode_long(buf, index, &e);
+                v[key] = e;
+            }
+        });
+}
+
+static void bench_atoms(size_t n) {
+    static const char* kinds[] = {"created", "updated", "deleted", "archived"};
+    static const char* states[] = {"ok", "error", "pending", "timeout", "retry", "cancelled"};
+
+    std::vector<Event_t> value;
+    for(size_t i = 0; i < n; i++) {
+        value.push_back(std::make_tuple(eipp::Atom(kinds[i % 4]), eipp::Atom(states[i % 6]), (long)i));
+    }
+
+    std::string name = "atoms x" + std::to_string(n);
+    bench_corpus(name.c_str(), value, n,
+        [](ei_x_buff* x, const std::vector<Event_t>& v) {
+            ei_x_encode_list_header(x, (long)v.size());
+            for(auto& e: v) {
+                ei_x_encode_tuple_header(x, 3);
+                ei_x_encode_atom_len(x, std::get<0>(e).get_value().data(), (int)std::get<0>(e).get_value().size());
+                ei_x_encode_atom_len(x, std::get<1>(e).get_value().data(), (int)std::get<1>(e).get_value().size());
+                ei_x_encode_long(x, std::get<2>(e));
+            }
+            ei_x_encode_empty_list(x);
+        },
+        [](const char* buf, int* index, std::vector<Event_t>& v) {
+            raw_decode_list(buf, index, [&]() {
+                int arity = 0;
+                long seq = 0;
+                ei_decode_tuple_header(buf, index, &arity);
+                eipp::Atom kind = raw_decode_atom(buf, index);
+                eipp::Atom state = raw_decode_atom(buf, index);
+                ei_decode_long(buf, index, &seq);
+                v.push_back(std::make_tuple(kind, state, seq));
+            });
+        });
+}
+
+
+// --- compression -------------------------------------------------------------
+
+#ifdef EIPP_WITH_ZLIB
+template <typename T>
+void bench_compression(const char* name, const T& value, int level) {
+    std::string plain, packed;
+
+    double encode_plain = seconds_per_run([&]() {
+        eipp::EIEncoder en;
+        en.encode(value);
+        plain = en.get_data();
+    });
+
+    double encode_packed = seconds_per_run([&]() {
+        eipp::EIEncoder en;
+        en.set_compression(1, level);
+        en.encode(value);
+        packed = en.get_data();
+    });
+
+    double decode_plain = seconds_per_run([&]() {
+        eipp::EIDecoder decoder(plain.data(), plain.size());
+        decoder.decode<T>();
+    });
+
+    double decode_packed = seconds_per_run([&]() {
+        eipp::EIDecoder decoder(packed.data(), packed.size());
+        decoder.decode<T>();
+    });
+
+    double saved = (double)plain.size() - (double)packed.size();
+    double extra = (encode_packed - encode_plain) + (decode_packed - decode_plain);
+
+    std::cout << std::left << std::setw(18) << name
+              << std::right << std::setw(3) << level
+              << std::setw(10) << plain.size()
+              << std::setw(10) << packed.size()
+              << std::setw(11) << std::fixed << std::setprecision(1) << extra * 1e6;
+    if(saved <= 0) {
+        std::cout << std::setw(17) << "never" << std::endl;
+    } else if(extra <= 0) {
+        std::cout << std::setw(17) << "always" << std::endl;
+    } else {
+        std::cout << std::setw(17) << std::setprecision(1) << saved / extra / 1e6 << std::endl;
+    }
+}
+
+static void bench_compression_all() {
+    std::cout << std::left << std::setw(18) << "payload"
+              << std::right << std::setw(3) << "lvl"
+              << std::setw(10) << "plain B"
+              << std::setw(10) << "zlib B"
+              << std::setw(11) << "extra us"
+              << std::setw(17) << "break-even MB/s" << std::endl;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> dist(-1e6, 1e6);
+
+    for(size_t n: {16, 256, 4096, 65536}) {
+        std::vector<std::string> lines(n, "GET /api/v1/items?page=1 200");
+        std::vector<double> samples(n);
+        for(auto& v: samples) v = dist(rng);
+        std::vector<long> counters(n);
+        for(size_t i = 0; i < n; i++) counters[i] = (long)(i * 1000);
+
+        auto log = std::make_tuple(std::string("log"), lines);
+        std::string name = "log lines x" + std::to_string(n);
+        for(int level: {1, 6}) bench_compression(name.c_str(), log, level);
+
+        name = "doubles x" + std::to_string(n);
+        for(int level: {1, 6}) bench_compression(name.c_str(), samples, level);
+
+        name = "counters x" + std::to_string(n);
+        for(int level: {1, 6}) bench_compression(name.c_str(), counters, level);
+    }
+    std::cout << std::endl;
+}
+#endif
+
+
+int main(int argc, char** argv) {
+    if(selected(argc, argv, "corpora") || selected(argc, argv, "ints")) {
+        bench_ints(100);
+        bench_ints(100000);
+    }
+    if(selected(argc, argv, "corpora") || selected(argc, argv, "people")) {
+        bench_people(10);
+        bench_people(10000);
+    }
+    if(selected(argc, argv, "corpora") || selected(argc, argv, "binaries")) {
+        bench_blobs(1, 1 << 20);
+        bench_blobs(64, 16 << 10);
+    }
+    if(selected(argc, argv, "corpora") || selected(argc, argv, "map")) {
+        bench_map(100);
+        bench_map(100000);
+    }
+    if(selected(argc, argv, "corpora") || selected(argc, argv, "atoms")) {
+        bench_atoms(10000);
+    }
+
+#ifdef EIPP_WITH_ZLIB
+    if(selected(argc, argv, "compression")) {
+        bench_compression_all();
+    }
+#else
+    if(argc >= 2 && selected(argc, argv, "compression")) {
+        std::cout << "compression: build with -DEIPP_WITH_ZLIB -lz" << std::endl;
+    }
+#endif
+
+    return 0;
+}
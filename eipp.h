@@ -6,13 +6,49 @@
 #include <list>
 #include <deque>
 #include <map>
-#include <stack>
+#include <unordered_map>
+#include <initializer_list>
 #include <tuple>
 #include <type_traits>
 #include <iterator>
+#include <algorithm>
+#include <utility>
 #include <functional>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <ostream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <ei.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define EIPP_POSIX 1
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#endif
+
+// define EIPP_WITH_ZLIB (and link with -lz) for compressed terms
+#ifdef EIPP_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+// define EIPP_ENABLE_STATS to count what encoders and decoders do, see Stats
+#ifdef EIPP_ENABLE_STATS
+#include <chrono>
+#endif
+
 namespace eipp {
 
 class EIEncoder;
@@ -30,6 +66,410 @@ enum class TYPE {
 };
 
 
+// Non-owning pointer + length into a buffer, produced by the view types
+// (BinaryView, StringView, AtomView). Valid as long as that buffer lives.
+class ByteView {
+public:
+    ByteView(): data_(nullptr), size_(0) {}
+    ByteView(const char* data, size_t size): data_(data), size_(size) {}
+    ByteView(const char* str): data_(str), size_(std::strlen(str)) {}
+    ByteView(const std::string& str): data_(str.data()), size_(str.size()) {}
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const char* begin() const {
+        return data_;
+    }
+
+    const char* end() const {
+        return data_ + size_;
+    }
+
+    char operator[] (size_t i) const {
+        return data_[i];
+    }
+
+    std::string to_string() const {
+        return std::string(data_, size_);
+    }
+
+    bool operator == (const ByteView& rhs) const {
+        return size_ == rhs.size_ && (size_ == 0 || std::memcmp(data_, rhs.data_, size_) == 0);
+    }
+
+    bool operator != (const ByteView& rhs) const {
+        return !(*this == rhs);
+    }
+
+    // used for map key
+    bool operator < (const ByteView& rhs) const {
+        int c = std::memcmp(data_, rhs.data_, std::min(size_, rhs.size_));
+        return c < 0 || (c == 0 && size_ < rhs.size_);
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+inline std::ostream& operator << (std::ostream& os, const ByteView& view) {
+    return os.write(view.data(), (std::streamsize)view.size());
+}
+
+
+// Placeholder for a position of a schema that is not needed: the term there
+// is stepped over with ei_skip_term and nothing is constructed for it, e.g.
+// eipp::Tuple<eipp::Atom, eipp::Skip, eipp::Skip, eipp::Binary>.
+struct Skip {};
+
+
+// What the encoders and decoders of the process did, counted when built with
+// -DEIPP_ENABLE_STATS. Without it nothing is counted, every hook compiles to
+// nothing and stats() returns zeros.
+struct Stats {
+    uint64_t nodes_decoded[8];      // indexed by (size_t)TYPE
+    uint64_t terms_decoded;         // successful EIDecoder::parse() and decode()
+    uint64_t bytes_decoded;         // the version byte not included
+    uint64_t decode_nanoseconds;
+    uint64_t terms_encoded;         // encoders finished, see EIEncoder::finish()
+    uint64_t bytes_encoded;
+    uint64_t encode_nanoseconds;
+    uint64_t buffer_allocations;    // encoder buffers allocated or grown
+    uint64_t arena_blocks;          // blocks allocated by Arenas
+};
+
+// One top level decode or encode, as handed to the stats callback.
+struct TermStats {
+    bool encode;
+    size_t bytes;
+    uint64_t nanoseconds;
+};
+
+
+namespace detail {
+    enum StatsCounter: size_t {
+        stat_nodes_decoded = 0,     // one per TYPE
+        stat_terms_decoded = 8,
+        stat_bytes_decoded,
+        stat_decode_nanoseconds,
+        stat_terms_encoded,
+        stat_bytes_encoded,
+        stat_encode_nanoseconds,
+        stat_buffer_allocations,
+        stat_arena_blocks,
+        stat_count
+    };
+
+#ifdef EIPP_ENABLE_STATS
+    // Every thread counts into counters only it writes, so counting costs a
+    // plain increment. stats() sums them up; the counters of threads that
+    // have exited are kept in `retired_`.
+    class StatsRegistry {
+    public:
+        struct Counters {
+            std::atomic<uint64_t> values[stat_count];
+
+            Counters() {
+                for(auto& value: values) value.store(0, std::memory_order_relaxed);
+            }
+        };
+
+        static StatsRegistry& instance() {
+            static StatsRegistry registry;
+            return registry;
+        }
+
+        void attach(Counters* counters) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            threads_.push_back(counters);
+        }
+
+        void detach(Counters* counters) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for(size_t i = 0; i < stat_count; i++) {
+                retired_[i] += counters->values[i].load(std::memory_order_relaxed);
+            }
+            threads_.erase(std::find(threads_.begin(), threads_.end(), counters));
+        }
+
+        // totals since the last reset()
+        void sum(uint64_t* out) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            total(out);
+            for(size_t i = 0; i < stat_count; i++) out[i] -= baseline_[i];
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            total(baseline_);
+        }
+
+        std::function<void(const TermStats&)> callback;
+
+    private:
+        StatsRegistry(): retired_(), baseline_() {}
+
+        void total(uint64_t* out) const {
+            for(size_t i = 0; i < stat_count; i++) {
+                out[i] = retired_[i];
+                for(auto* counters: threads_) {
+                    out[i] += counters->values[i].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::mutex mutex_;
+        std::vector<Counters*> threads_;
+        uint64_t retired_[stat_count];
+        uint64_t baseline_[stat_count];
+    };
+
+    struct ThreadStats {
+        StatsRegistry::Counters counters;
+
+        ThreadStats() {
+            StatsRegistry::instance().attach(&counters);
+        }
+
+        ~ThreadStats() {
+            StatsRegistry::instance().detach(&counters);
+        }
+    };
+
+    inline StatsRegistry::Counters& thread_counters() {
+        static thread_local ThreadStats stats;
+        return stats.counters;
+    }
+#endif
+
+    inline void stats_add(StatsCounter counter, uint64_t n) {
+#ifdef EIPP_ENABLE_STATS
+        std::atomic<uint64_t>& value = thread_counters().values[counter];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#else
+        (void)counter;
+        (void)n;
+#endif
+    }
+
+    inline void stats_nodes(TYPE type, uint64_t n = 1) {
+        stats_add(StatsCounter(stat_nodes_decoded + (size_t)type), n);
+    }
+
+    // the start of a top level decode or encode, 0 when not counting
+    inline uint64_t stats_clock() {
+#ifdef EIPP_ENABLE_STATS
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+        return 0;
+#endif
+    }
+
+    // a top level decode or encode of `bytes` that began at `start` is done
+    inline void stats_term(bool encode, size_t bytes, uint64_t start) {
+#ifdef EIPP_ENABLE_STATS
+        TermStats term;
+        term.encode = encode;
+        term.bytes = bytes;
+        term.nanoseconds = stats_clock() - start;
+
+        stats_add(encode ? stat_terms_encoded : stat_terms_decoded, 1);
+        stats_add(encode ? stat_bytes_encoded : stat_bytes_decoded, bytes);
+        stats_add(encode ? stat_encode_nanoseconds : stat_decode_nanoseconds, term.nanoseconds);
+
+        auto& callback = StatsRegistry::instance().callback;
+        if(callback) callback(term);
+#else
+        (void)encode;
+        (void)bytes;
+        (void)start;
+#endif
+    }
+}
+
+// totals of all threads since the start or the last reset_stats()
+inline Stats stats() {
+    uint64_t values[detail::stat_count] = {};
+#ifdef EIPP_ENABLE_STATS
+    detail::StatsRegistry::instance().sum(values);
+#endif
+
+    Stats s;
+    for(size_t i = 0; i < 8; i++) {
+        s.nodes_decoded[i] = values[detail::stat_nodes_decoded + i];
+    }
+    s.terms_decoded = values[detail::stat_terms_decoded];
+    s.bytes_decoded = values[detail::stat_bytes_decoded];
+    s.decode_nanoseconds = values[detail::stat_decode_nanoseconds];
+    s.terms_encoded = values[detail::stat_terms_encoded];
+    s.bytes_encoded = values[detail::stat_bytes_encoded];
+    s.encode_nanoseconds = values[detail::stat_encode_nanoseconds];
+    s.buffer_allocations = values[detail::stat_buffer_allocations];
+    s.arena_blocks = values[detail::stat_arena_blocks];
+    return s;
+}
+
+inline void reset_stats() {
+#ifdef EIPP_ENABLE_STATS
+    detail::StatsRegistry::instance().reset();
+#endif
+}
+
+// `callback` runs after every top level decode or encode, on the thread
+// that did it, e.g. to feed a latency histogram. Set it before other
+// threads start encoding or decoding; an empty function removes it.
+inline void set_stats_callback(std::function<void(const TermStats&)> callback) {
+#ifdef EIPP_ENABLE_STATS
+    detail::StatsRegistry::instance().callback = std::move(callback);
+#else
+    (void)callback;
+#endif
+}
+
+
+namespace detail {
+    template <typename T, typename = void>
+    struct needs_cleanup;
+}
+
+
+// Bump allocator that owns every node produced by EIDecoder.
+//
+// Memory is carved sequentially out of a few large blocks, and objects that
+// hold resources of their own (e.g. std::string values) register a cleanup
+// which runs on reset(). reset() keeps the blocks, so an Arena reused across
+// messages stops allocating once it has grown to the working size.
+class Arena {
+public:
+    explicit Arena(size_t block_size = 4096):
+            block_size_(block_size), next_block_(0), ptr_(nullptr), end_(nullptr), cleanups_(nullptr) {}
+
+    Arena(const Arena&) = delete;
+    Arena&operator = (const Arena&) = delete;
+
+    ~Arena() {
+        reset();
+        for(auto& block: blocks_) {
+            ::operator delete(block.data);
+        }
+    }
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t p = align_up(ptr_, align);
+        if(ptr_ == nullptr || p + size > reinterpret_cast<uintptr_t>(end_)) {
+            next_block(size + align);
+            p = align_up(ptr_, align);
+        }
+
+        ptr_ = reinterpret_cast<char*>(p + size);
+        return reinterpret_cast<void*>(p);
+    }
+
+    template <typename T>
+    T* allocate_array(size_t n) {
+        if(n == 0) return nullptr;
+        return static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    template <typename T, typename ... Args>
+    T* create(Args&& ... args) {
+        T* obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if(detail::needs_cleanup<T>::value) {
+            auto* c = new (allocate(sizeof(Cleanup), alignof(Cleanup))) Cleanup();
+            c->destroy = &Arena::destroy<T>;
+            c->object = obj;
+            c->prev = cleanups_;
+            cleanups_ = c;
+        }
+        return obj;
+    }
+
+    // destroy every object created since the last reset, keep the memory.
+    void reset() {
+        for(Cleanup* c = cleanups_; c; c = c->prev) {
+            c->destroy(c->object);
+        }
+
+        cleanups_ = nullptr;
+        next_block_ = 0;
+        ptr_ = nullptr;
+        end_ = nullptr;
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for(auto& block: blocks_) {
+            total += block.size;
+        }
+        return total;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    struct Cleanup {
+        void (*destroy)(void*);
+        void* object;
+        Cleanup* prev;
+    };
+
+    template <typename T>
+    static void destroy(void* p) {
+        static_cast<T*>(p)->~T();
+    }
+
+    static uintptr_t align_up(const char* p, size_t align) {
+        return (reinterpret_cast<uintptr_t>(p) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+
+    void next_block(size_t need) {
+        while(next_block_ < blocks_.size()) {
+            Block& block = blocks_[next_block_++];
+            if(block.size >= need) {
+                ptr_ = block.data;
+                end_ = block.data + block.size;
+                return;
+            }
+        }
+
+        // grow geometrically so a big message needs only a handful of blocks
+        size_t size = block_size_ << std::min<size_t>(blocks_.size(), 10);
+        if(size < need) size = need;
+
+        Block block;
+        block.data = static_cast<char*>(::operator new(size));
+        detail::stats_add(detail::stat_arena_blocks, 1);
+        block.size = size;
+        blocks_.push_back(block);
+        next_block_ = blocks_.size();
+
+        ptr_ = block.data;
+        end_ = block.data + block.size;
+    }
+
+    size_t block_size_;
+    size_t next_block_;
+    char* ptr_;
+    char* end_;
+    Cleanup* cleanups_;
+    std::vector<Block> blocks_;
+};
+
+
 namespace detail {
     template <int index, typename Head, typename ... Tail>
     struct TypeByIndex {
@@ -44,16 +484,26 @@ namespace detail {
     class _Base {
     public:
         virtual ~_Base(){}
-        virtual int decode(const char* buf, int* index) = 0;
+        virtual int decode(const char* buf, int* index, Arena* arena) = 0;
     };
 
+    // nodes tell the Arena whether their destructor has anything to release
+    template <typename T, typename>
+    struct needs_cleanup: std::integral_constant<bool, !std::is_trivially_destructible<T>::value> {};
+
+    template <typename T>
+    struct needs_cleanup<T, typename std::enable_if<std::is_base_of<_Base, T>::value>::type>:
+            std::integral_constant<bool, T::needs_cleanup> {};
+
     template <TYPE tp, typename T, typename Decoder>
     class SingleType: public _Base {
     public:
         static const TYPE category_type = tp;
         static const bool is_single = true;
+        static const bool needs_cleanup = !std::is_trivially_destructible<T>::value;
         typedef SingleType<tp, T, Decoder> self_type;
         typedef T value_type;
+        typedef Decoder decoder_type;
 
         SingleType(): value(T()) {}
         SingleType(const T& v): value(v) {}
@@ -94,41 +544,100 @@ namespace detail {
             return value;
         }
 
-        int decode(const char* buf, int* index) override {
-            return Decoder()(buf, index, value);
+        const T& get_value() const {
+            return value;
+        }
+
+        int decode(const char* buf, int* index, Arena* arena) override {
+            stats_nodes(tp);
+            return Decoder()(buf, index, value, arena);
         }
 
     private:
         friend class ::eipp::EIEncoder;
+        friend class ::eipp::EIDecoder;
         T value;
     };
 
 
+    inline unsigned get_be16(const char* p) {
+        const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+        return ((unsigned)s[0] << 8) | (unsigned)s[1];
+    }
+
+    inline uint32_t get_be32(const char* p) {
+        const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+        return ((uint32_t)s[0] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 8) | (uint32_t)s[3];
+    }
+
+    // Move a decoding index `n` bytes on; false when that passes INT_MAX.
+    // ei indexes are ints, which limits a term to 2 GiB.
+    inline bool advance(int* index, size_t n) {
+        if(n > (size_t)(std::numeric_limits<int>::max() - *index)) return false;
+        *index += (int)n;
+        return true;
+    }
+
+    inline void put_be32(char* p, uint32_t v) {
+        p[0] = (char)(v >> 24);
+        p[1] = (char)(v >> 16);
+        p[2] = (char)(v >> 8);
+        p[3] = (char)v;
+    }
+
+    // term_to_binary(T, [compressed]): 131, 80, uncompressed size, zlib data
+    const char compressed_tag = 80;
+    const size_t compressed_header_size = 6;
+
+    // deflate never shrinks data more than 1032:1, so a larger uncompressed
+    // size than that is a lie, and is not allocated
+    const size_t max_inflate_ratio = 1032;
+
+    inline void put_be64(char* p, uint64_t v) {
+        put_be32(p, (uint32_t)(v >> 32));
+        put_be32(p + 4, (uint32_t)v);
+    }
+
+    inline uint64_t get_be64(const char* p) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return __builtin_bswap64(v);
+#else
+        return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+#endif
+    }
+
+    inline double get_be_double(const char* p) {
+        uint64_t bits = get_be64(p);
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+
     struct LongDecoder {
-        int operator ()(const char* buf, int* index, long& value) {
+        int operator ()(const char* buf, int* index, long& value, Arena*) {
             return ei_decode_long(buf, index, &value);
         }
     };
 
     struct DoubleDecoder {
-        int operator ()(const char* buf, int* index, double& value) {
+        int operator ()(const char* buf, int* index, double& value, Arena*) {
             return ei_decode_double(buf, index, &value);
         }
     };
 
+    // decode straight into the string's own storage, reusing its capacity
     template <int(*decode_func)(const char*, int*, char *)>
     struct StringDecoderImpl {
-        int operator ()(const char* buf, int* index, std::string& value) {
+        int operator ()(const char* buf, int* index, std::string& value, Arena*) {
             int tp=0, len=0, ret=0;
             ret = ei_get_type(buf, index, &tp, &len);
             if(ret == -1) return ret;
 
-            char* ptr = new char[len+1]();
-            ret = decode_func(buf, index, ptr);
-            if(ret == -1) return ret;
-
-            value = std::string(ptr, (unsigned long)len);
-            delete[] ptr;
+            value.resize((size_t)len + 1);
+            ret = decode_func(buf, index, &value[0]);
+            value.resize(ret == -1 ? 0 : (size_t)len);
             return ret;
         }
     };
@@ -137,183 +646,634 @@ namespace detail {
     using AtomDecoder = StringDecoderImpl<ei_decode_atom>;
 
     struct BinaryDecoder {
-        int operator ()(const char* buf, int* index, std::string& value) {
+        int operator ()(const char* buf, int* index, std::string& value, Arena*) {
             int tp=0, len=0, ret=0;
             ret = ei_get_type(buf, index, &tp, &len);
             if(ret == -1) return ret;
 
-            char* ptr = new char[len+1]();
-            ret = ei_decode_binary(buf, index, ptr, (long*)&len);
+            long size = 0;
+            value.resize((size_t)len);
+            ret = ei_decode_binary(buf, index, &value[0], &size);
+            value.resize(ret == -1 ? 0 : (size_t)size);
+            return ret;
+        }
+    };
+
+    // The view decoders point into the input buffer instead of copying.
+
+    struct BinaryViewDecoder {
+        int operator ()(const char* buf, int* index, ByteView& value, Arena*) {
+            const char* s = buf + *index;
+            if(*s != ERL_BINARY_EXT) return -1;
+
+            uint32_t len = get_be32(s + 1);
+            if(!advance(index, 5 + (size_t)len)) return -1;
+            value = ByteView(s + 5, len);
+            return 0;
+        }
+    };
+
+    // Bytes of the atom as found on the wire: Latin-1 for ATOM_EXT and
+    // SMALL_ATOM_EXT, UTF-8 for the *_UTF8_EXT tags.
+    struct AtomViewDecoder {
+        int operator ()(const char* buf, int* index, ByteView& value, Arena*) {
+            const char* s = buf + *index;
+            size_t len = 0, header = 0;
+
+            switch(*s) {
+                case ERL_ATOM_EXT:
+                case ERL_ATOM_UTF8_EXT:
+                    len = get_be16(s + 1);
+                    header = 3;
+                    break;
+                case ERL_SMALL_ATOM_EXT:
+                case ERL_SMALL_ATOM_UTF8_EXT:
+                    len = (unsigned char)s[1];
+                    header = 2;
+                    break;
+                default:
+                    return -1;
+            }
+
+            if(!advance(index, header + len)) return -1;
+            value = ByteView(s + header, len);
+            return 0;
+        }
+    };
+
+    // STRING_EXT is viewed in place. Erlang sends strings longer than 65535
+    // bytes as a list of small integers, which is not contiguous; those are
+    // gathered into the Arena instead.
+    struct StringViewDecoder {
+        int operator ()(const char* buf, int* index, ByteView& value, Arena* arena) {
+            const char* s = buf + *index;
+
+            if(*s == ERL_NIL_EXT) {
+                value = ByteView();
+                *index += 1;
+                return 0;
+            }
+
+            if(*s == ERL_STRING_EXT) {
+                size_t len = get_be16(s + 1);
+                if(!advance(index, 3 + len)) return -1;
+                value = ByteView(s + 3, len);
+                return 0;
+            }
+
+            int tp=0, len=0, ret=0;
+            ret = ei_get_type(buf, index, &tp, &len);
+            if(ret == -1 || tp != ERL_LIST_EXT) return -1;
+
+            char* ptr = static_cast<char*>(arena->allocate((size_t)len + 1, 1));
+            ret = ei_decode_string(buf, index, ptr);
             if(ret == -1) return ret;
 
-            value = std::string(ptr, (unsigned long)len);
-            delete[] ptr;
-            return ret;
+            value = ByteView(ptr, (size_t)len);
+            return 0;
+        }
+    };
+
+
+    // Nodes that own containers take the Arena the containers allocate from.
+    template <typename T>
+    typename std::enable_if<T::is_single, T*>::type
+    new_node(Arena* arena) {
+        return arena->create<T>();
+    }
+
+    template <typename T>
+    typename std::enable_if<!T::is_single, T*>::type
+    new_node(Arena* arena) {
+        return arena->create<T>(arena);
+    }
+
+    // How a List element, Map key or Map value is stored: single types by
+    // value, compound types as a pointer to their node.
+    template <typename T, bool = T::is_single>
+    struct Element {
+        typedef typename T::value_type type;
+
+        static int decode(const char* buf, int* index, Arena* arena, type& out) {
+            stats_nodes(T::category_type);
+            return typename T::decoder_type()(buf, index, out, arena);
+        }
+    };
+
+    template <typename T>
+    struct Element<T, false> {
+        typedef T* type;
+
+        static int decode(const char* buf, int* index, Arena* arena, type& out) {
+            if(out == nullptr) out = new_node<T>(arena);
+            return out->T::decode(buf, index, arena);
+        }
+    };
+
+
+    // Bulk decoding of numeric lists. decode() converts the leading elements
+    // that use the common tags (SMALL_INTEGER_EXT and INTEGER_EXT, or
+    // NEW_FLOAT_EXT) in one tight loop and stops at the first element that
+    // does not, or that does not fit T, returning how many it converted. The
+    // caller decodes that element the generic way and carries on.
+    template <typename T, typename = void>
+    struct ListRun {
+        static const bool bulk = false;
+    };
+
+    template <typename T>
+    struct ListRun<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+        static const bool bulk = true;
+
+        static bool fits(int64_t v) {
+            return std::numeric_limits<T>::is_signed ?
+                    v >= (int64_t)std::numeric_limits<T>::min() && v <= (int64_t)std::numeric_limits<T>::max() :
+                    v >= 0 && (uint64_t)v <= (uint64_t)std::numeric_limits<T>::max();
+        }
+
+        static size_t decode(const char* buf, int* index, T* out, size_t n) {
+            const char* s = buf + *index;
+            size_t i = 0;
+            for(; i < n; i++) {
+                int64_t v;
+                size_t step;
+                if(*s == ERL_SMALL_INTEGER_EXT) {
+                    v = (unsigned char)s[1];
+                    step = 2;
+                } else if(*s == ERL_INTEGER_EXT) {
+                    v = (int32_t)get_be32(s + 1);
+                    step = 5;
+                } else {
+                    break;
+                }
+
+                if(!fits(v)) break;
+                out[i] = (T)v;
+                s += step;
+            }
+
+            *index = (int)(s - buf);
+            stats_nodes(TYPE::Integer, i);
+            return i;
+        }
+
+        // STRING_EXT payload, one byte per element
+        static bool decode_bytes(const char* s, size_t len, T* out) {
+            if(!fits(0xff)) {
+                for(size_t i = 0; i < len; i++) {
+                    if(!fits((unsigned char)s[i])) return false;
+                }
+            }
+
+            if(sizeof(T) == 1) {
+                memcpy(out, s, len);
+            } else {
+                for(size_t i = 0; i < len; i++) {
+                    out[i] = (T)(unsigned char)s[i];
+                }
+            }
+            stats_nodes(TYPE::Integer, len);
+            return true;
+        }
+    };
+
+    template <typename T>
+    struct ListRun<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+        static const bool bulk = true;
+
+        static size_t decode(const char* buf, int* index, T* out, size_t n) {
+            const char* s = buf + *index;
+            size_t i = 0;
+            for(; i < n && *s == NEW_FLOAT_EXT; i++, s += 9) {
+                out[i] = (T)get_be_double(s + 1);
+            }
+
+            *index = (int)(s - buf);
+            stats_nodes(TYPE::Float, i);
+            return i;
         }
     };
 
 
     template <typename ... Ts>
-    int compound_decoder(const char* buf, int* index, std::vector<class _Base*>*);
+    struct compound_decoder;
 
     template <typename T, typename ... Ts>
-    int compound_decoder_helper(const char* buf, int* index, std::vector<class _Base*>* vec) {
-        class _Base* t = new T();
-        int ret = t->decode(buf, index);
-        vec->push_back(t);
-
-        if(ret==-1) {
-            return ret;
-        } else {
-            return compound_decoder<Ts...>(buf, index, vec);
+    struct compound_decoder<T, Ts...> {
+        static int decode(const char* buf, int* index, Arena* arena, _Base** out) {
+            // a node left by an earlier decode is decoded again in place
+            T* t = *out ? static_cast<T*>(*out) : new_node<T>(arena);
+            *out = t;
+
+            int ret = t->T::decode(buf, index, arena);
+            if(ret == -1) {
+                return ret;
+            } else {
+                return compound_decoder<Ts...>::decode(buf, index, arena, out + 1);
+            }
         }
     };
 
     template <typename ... Ts>
-    int compound_decoder(const char* buf, int* index, std::vector<class _Base*>* vec) {
-        return compound_decoder_helper<Ts...>(buf, index, vec);
-    }
+    struct compound_decoder<Skip, Ts...> {
+        static int decode(const char* buf, int* index, Arena* arena, _Base** out) {
+            *out = nullptr;
+
+            int ret = ei_skip_term(buf, index);
+            if(ret == -1) {
+                return ret;
+            } else {
+                return compound_decoder<Ts...>::decode(buf, index, arena, out + 1);
+            }
+        }
+    };
 
     template <>
-    int compound_decoder<>(const char*, int*, std::vector<class _Base*>*) {
-        return 0;
-    }
+    struct compound_decoder<> {
+        static int decode(const char*, int*, Arena*, _Base**) {
+            return 0;
+        }
+    };
 
     template <TYPE tp, int(*_decode_header_func)(const char*, int*, int*), typename T, typename ... Types>
     class CompoundType: public _Base {
     public:
         static const TYPE category_type = tp;
         static const bool is_single = false;
+        static const bool needs_cleanup = false;    // children live in the same Arena
         typedef CompoundType<tp, _decode_header_func, T, Types...> self_type;
         typedef self_type* value_type;    // not use, but should be here for std::conditional;
 
-        CompoundType(): arity(0) {}
-
-        ~CompoundType() {
-            for(class _Base* ptr: value_ptr_vec) {
-                delete ptr;
-            }
-
-            value_ptr_vec.clear();
-        }
+        explicit CompoundType(Arena* = nullptr): arity(0), value_ptr_vec(nullptr) {}
 
+        // the element types are fixed by the template, so no dynamic_cast is needed
         template <int index, typename ThisType = typename TypeByIndex<index, T, Types...>::type>
         typename std::enable_if<ThisType::is_single, typename ThisType::value_type>::type
         get() {
-            return dynamic_cast<ThisType*>(value_ptr_vec[index])->get_value();
+            return static_cast<ThisType*>(value_ptr_vec[index])->get_value();
         };
 
         template <int index, typename ThisType = typename TypeByIndex<index, T, Types...>::type>
         typename std::enable_if<!ThisType::is_single, ThisType*>::type
         get() {
-            return dynamic_cast<ThisType*>(value_ptr_vec[index]);
+            return static_cast<ThisType*>(value_ptr_vec[index]);
         };
 
-        int decode(const char* buf, int* index) override {
+        int decode(const char* buf, int* index, Arena* arena) override {
             int ret = 0;
             ret = _decode_header_func(buf, index, &arity);
-            if (ret == 0) {
-                if(sizeof...(Types) == 0) {
-                    for(int i=0; i<arity; i++) {
-                        ret = compound_decoder<T>(buf, index, &value_ptr_vec);
-                        if(ret == -1) return ret;
-                    }
-                } else {
-                    ret = compound_decoder<T, Types...>(buf, index, &value_ptr_vec);
-                }
+            if(ret == -1) return ret;
+            stats_nodes(TYPE::Tuple);
+
+            if(arity != (int)sizeof...(Types) + 1) {
+                return -1;
             }
 
-            return ret;
+            if(value_ptr_vec == nullptr) {
+                value_ptr_vec = arena->allocate_array<_Base*>((size_t)arity);
+                std::fill(value_ptr_vec, value_ptr_vec + arity, nullptr);
+            }
+            return compound_decoder<T, Types...>::decode(buf, index, arena, value_ptr_vec);
         }
 
     protected:
         int arity;
-        std::vector<class _Base*> value_ptr_vec;
+        _Base** value_ptr_vec;
     };
 
 
+    // Allocates from an Arena, or from the heap when there is none (a node
+    // constructed by hand rather than by a decoder).
     template <typename T>
-    class SoleTypeListType: public CompoundType<TYPE::List, ei_decode_list_header, T> {
-    public:
-        typedef std::vector<class _Base*>::iterator IterType;
+    struct ArenaAllocator {
+        typedef T value_type;
 
-        struct Iterator: public std::iterator<std::forward_iterator_tag, IterType> {
-            IterType iter;
-            Iterator(IterType i): iter(i) {}
-            Iterator(const Iterator& rhs): iter(rhs.iter) {}
-            Iterator&operator = (const Iterator& rhs) {
-                iter = rhs.iter;
-                return *this;
-            }
+        Arena* arena;
 
-            Iterator operator ++ () {
-                ++iter;
-                return *this;
+        explicit ArenaAllocator(Arena* a = nullptr): arena(a) {}
+
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U>& rhs): arena(rhs.arena) {}
+
+        T* allocate(size_t n) {
+            if(arena) return arena->allocate_array<T>(n);
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, size_t) {
+            if(!arena) ::operator delete(p);
+        }
+
+        template <typename U>
+        bool operator == (const ArenaAllocator<U>& rhs) const {
+            return arena == rhs.arena;
+        }
+
+        template <typename U>
+        bool operator != (const ArenaAllocator<U>& rhs) const {
+            return arena != rhs.arena;
+        }
+    };
+
+
+    // Elements are stored contiguously: values for single types, node
+    // pointers for compound ones. Iterators are random access. A list
+    // decoded again keeps the elements past its new length as spares, so
+    // their nodes and strings serve the next longer message.
+    template <typename T>
+    class SoleTypeListType: public _Base {
+    public:
+        static const TYPE category_type = TYPE::List;
+        static const bool is_single = false;
+        typedef SoleTypeListType<T> self_type;
+        typedef self_type* value_type;    // not use, but should be here for std::conditional;
+
+        typedef typename Element<T>::type element_type;
+        typedef std::vector<element_type, ArenaAllocator<element_type>> storage_type;
+        typedef typename storage_type::iterator iterator;
+        typedef typename storage_type::const_iterator const_iterator;
+
+        // the memory belongs to the Arena, only the elements may need destroying
+        static const bool needs_cleanup = !std::is_trivially_destructible<element_type>::value;
+
+        explicit SoleTypeListType(Arena* arena = nullptr): value(ArenaAllocator<element_type>(arena)), size_(0) {}
+
+        iterator begin() {
+            return value.begin();
+        }
+
+        iterator end() {
+            return value.begin() + (std::ptrdiff_t)size_;
+        }
+
+        const_iterator begin() const {
+            return value.begin();
+        }
+
+        const_iterator end() const {
+            return value.begin() + (std::ptrdiff_t)size_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        element_type& operator[] (size_t i) {
+            return value[i];
+        }
+
+        const element_type& operator[] (size_t i) const {
+            return value[i];
+        }
+
+        int decode(const char* buf, int* index, Arena* arena) override {
+            stats_nodes(TYPE::List);
+
+            // Erlang sends a list of small integers as a byte string
+            if(buf[*index] == ERL_STRING_EXT) {
+                return decode_byte_string(buf, index);
             }
 
-            Iterator operator ++ (int) {
-                Iterator tmp = *this;
-                ++iter;
-                return tmp;
+            int arity = 0, ret = 0;
+            ret = ei_decode_list_header(buf, index, &arity);
+            if(ret == -1) return ret;
+
+            resize((size_t)arity);
+            ret = decode_elements(buf, index, arena, 0);
+            if(ret == -1) return ret;
+
+            // a proper list ends with a [] tail, or goes on in a list there
+            while(arity > 0) {
+                ret = ei_decode_list_header(buf, index, &arity);
+                if(ret == -1) return ret;
+
+                size_t from = size_;
+                resize(from + (size_t)arity);
+                if(decode_elements(buf, index, arena, from) == -1) return -1;
             }
 
-            bool operator == (const Iterator& rhs) {
-                return iter == rhs.iter;
+            return ret;
+        }
+
+    private:
+        // spare elements are kept, not destroyed
+        void resize(size_t n) {
+            if(n > value.size()) value.resize(n);
+            size_ = n;
+        }
+
+        template <typename E = element_type>
+        typename std::enable_if<ListRun<E>::bulk, int>::type
+        decode_elements(const char* buf, int* index, Arena* arena, size_t from) {
+            size_t n = size_;
+            for(size_t i = from; i < n; ) {
+                i += ListRun<E>::decode(buf, index, value.data() + i, n - i);
+                if(i < n && Element<T>::decode(buf, index, arena, value[i++]) == -1) return -1;
             }
+            return 0;
+        }
 
-            bool operator != (const Iterator& rhs) {
-                return iter != rhs.iter;
+        template <typename E = element_type>
+        typename std::enable_if<!ListRun<E>::bulk, int>::type
+        decode_elements(const char* buf, int* index, Arena* arena, size_t from) {
+            for(size_t i = from; i < size_; i++) {
+                if(Element<T>::decode(buf, index, arena, value[i]) == -1) return -1;
             }
+            return 0;
+        }
+
+        template <typename E = element_type>
+        typename std::enable_if<std::is_integral<E>::value && ListRun<E>::bulk, int>::type
+        decode_byte_string(const char* buf, int* index) {
+            const char* s = buf + *index;
+            size_t len = get_be16(s + 1);
+
+            resize(len);
+            if(!ListRun<E>::decode_bytes(s + 3, len, value.data())) return -1;
+
+            *index += 3 + (int)len;
+            return 0;
+        }
+
+        template <typename E = element_type>
+        typename std::enable_if<!(std::is_integral<E>::value && ListRun<E>::bulk), int>::type
+        decode_byte_string(const char*, int*) {
+            return -1;
+        }
 
-            template <typename X=T>
-            typename std::enable_if<X::is_single, typename X::value_type>::type
-            operator *() {
-                return dynamic_cast<X*>(*iter)->get_value();
+        storage_type value;
+        size_t size_;
+    };
+
+
+    template <typename T>
+    struct KeyHash: std::hash<T> {};
+
+    template <>
+    struct KeyHash<ByteView> {
+        size_t operator ()(const ByteView& v) const {
+            // FNV-1a
+            uint64_t h = 14695981039346656037ULL;
+            for(char c: v) {
+                h ^= (unsigned char)c;
+                h *= 1099511628211ULL;
             }
+            return (size_t)h;
+        }
+    };
+
+    // Map entries in one contiguous vector, sorted by key once decoded.
+    // Iteration is in key order and find() is a binary search.
+    template <typename K, typename V>
+    class SortedMap {
+    public:
+        typedef std::pair<K, V> entry_type;
+        typedef std::vector<entry_type, ArenaAllocator<entry_type>> container_type;
+        typedef typename container_type::iterator iterator;
+
+        explicit SortedMap(Arena* arena): entries_(ArenaAllocator<entry_type>(arena)), size_(0) {}
+
+        iterator begin() {
+            return entries_.begin();
+        }
+
+        iterator end() {
+            return entries_.begin() + (std::ptrdiff_t)size_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        iterator find(const K& key) {
+            auto it = std::lower_bound(begin(), end(), key, key_less);
+            return (it != end() && !(key < it->first)) ? it : end();
+        }
+
+        // Entries are decoded in place, then build() makes them searchable.
+        // Entries past `n` are kept as spares for a later, bigger map.
+        void resize(size_t n) {
+            if(n > entries_.size()) entries_.resize(n);
+            size_ = n;
+        }
+
+        entry_type& operator[] (size_t i) {
+            return entries_[i];
+        }
 
-            template <typename X=T>
-            typename std::enable_if<!X::is_single, X*>::type
-            operator *() {
-                return dynamic_cast<X*>(*iter);
+        void build() {
+            // small Erlang maps already arrive in key order
+            if(!std::is_sorted(begin(), end(), entry_less)) {
+                std::sort(begin(), end(), entry_less);
             }
+        }
 
-        };
+    private:
+        static bool key_less(const entry_type& e, const K& key) {
+            return e.first < key;
+        }
+
+        static bool entry_less(const entry_type& a, const entry_type& b) {
+            return a.first < b.first;
+        }
+
+        container_type entries_;
+        size_t size_;
+    };
+
+    // Map entries in one contiguous vector in wire order, plus an open
+    // addressing (linear probing) table of entry indexes for find().
+    template <typename K, typename V>
+    class HashMap {
+    public:
+        typedef std::pair<K, V> entry_type;
+        typedef std::vector<entry_type, ArenaAllocator<entry_type>> container_type;
+        typedef typename container_type::iterator iterator;
+
+        explicit HashMap(Arena* arena):
+                entries_(ArenaAllocator<entry_type>(arena)),
+                slots_(ArenaAllocator<uint32_t>(arena)), size_(0) {}
 
-        typedef Iterator iterator;
         iterator begin() {
-            return Iterator(this->value_ptr_vec.begin());
+            return entries_.begin();
         }
 
         iterator end() {
-            return Iterator(this->value_ptr_vec.end());
+            return entries_.begin() + (std::ptrdiff_t)size_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        iterator find(const K& key) {
+            if(slots_.empty()) return end();
+
+            size_t mask = slots_.size() - 1;
+            for(size_t i = KeyHash<K>()(key) & mask; slots_[i] != empty_slot; i = (i + 1) & mask) {
+                entry_type& e = entries_[slots_[i]];
+                if(e.first == key) return entries_.begin() + slots_[i];
+            }
+            return end();
+        }
+
+        // as SortedMap::resize, spares are kept
+        void resize(size_t n) {
+            if(n > entries_.size()) entries_.resize(n);
+            size_ = n;
+        }
+
+        entry_type& operator[] (size_t i) {
+            return entries_[i];
+        }
+
+        void build() {
+            // keep the load factor at or below one half
+            size_t n = 8;
+            while(n < size_ * 2) n <<= 1;
+            slots_.assign(n, empty_slot);
+
+            size_t mask = n - 1;
+            for(size_t e = 0; e < size_; e++) {
+                size_t i = KeyHash<K>()(entries_[e].first) & mask;
+                while(slots_[i] != empty_slot) i = (i + 1) & mask;
+                slots_[i] = (uint32_t)e;
+            }
         }
+
+    private:
+        enum: uint32_t { empty_slot = 0xffffffff };
+
+        container_type entries_;
+        std::vector<uint32_t, ArenaAllocator<uint32_t>> slots_;
+        size_t size_;
     };
 
-    template <typename KT, typename VT,
-            typename = typename std::enable_if<
-                    std::is_base_of<_Base, KT>::value && std::is_base_of<_Base, VT>::value>::type
-    >
+    template <typename KT, typename VT, typename Storage>
     class MapType: public _Base {
+        static_assert(std::is_base_of<_Base, KT>::value && std::is_base_of<_Base, VT>::value,
+                "Map keys and values must be eipp types");
+
     public:
         static const TYPE category_type = TYPE::Map;
         static const bool is_single = false;
-        typedef MapType<KT, VT> self_type;
+        typedef MapType<KT, VT, Storage> self_type;
         typedef self_type* value_type;    // not use, but should be here for std::conditional;
 
-        using KeyType = typename std::conditional<KT::is_single, typename KT::value_type, KT*>::type;
-        using ValueType = typename std::conditional<VT::is_single, typename VT::value_type, VT*>::type;
+        using KeyType = typename Element<KT>::type;
+        using ValueType = typename Element<VT>::type;
 
-        typedef typename std::map<KeyType, ValueType>::iterator iterator;
+        typedef typename Storage::template type<KeyType, ValueType> storage_type;
+        typedef typename storage_type::iterator iterator;
 
-        MapType(): arity(0) {}
-        ~MapType() {
-            for(_Base* ptr: value_ptr_vec) {
-                delete ptr;
-            }
+        static const bool needs_cleanup = !std::is_trivially_destructible<KeyType>::value ||
+                !std::is_trivially_destructible<ValueType>::value;
 
-            value.clear();
-            value_ptr_vec.clear();
-        }
+        explicit MapType(Arena* arena = nullptr): value(arena) {}
 
         iterator begin() {
             return value.begin();
@@ -323,59 +1283,38 @@ namespace detail {
             return value.end();
         }
 
-        int decode(const char* buf, int* index) override {
-            int ret = 0;
+        size_t size() const {
+            return value.size();
+        }
+
+        // end() when the key is absent
+        iterator find(const KeyType& key) {
+            return value.find(key);
+        }
+
+        int decode(const char* buf, int* index, Arena* arena) override {
+            int arity = 0, ret = 0;
             ret = ei_decode_map_header(buf, index, &arity);
             if(ret == -1) return ret;
+            stats_nodes(TYPE::Map);
 
+            value.resize((size_t)arity);
             for(int i = 0; i<arity; i++) {
-                KT* k = new KT();
-                ret = k->decode(buf, index);
-                if (ret == -1) return ret;
+                auto& entry = value[(size_t)i];
 
-                VT* v = new VT();
-                ret = v->decode(buf, index);
+                ret = Element<KT>::decode(buf, index, arena, entry.first);
                 if(ret == -1) return ret;
 
-                value_ptr_vec.push_back(k);
-                value_ptr_vec.push_back(v);
-                add_to_value(k, v);
+                ret = Element<VT>::decode(buf, index, arena, entry.second);
+                if(ret == -1) return ret;
             }
 
+            value.build();
             return ret;
         }
 
     private:
-        int arity;
-        std::map<KeyType, ValueType> value;
-        std::vector<_Base*> value_ptr_vec;
-
-        template <typename Kt = KT, typename Vt = VT>
-        typename std::enable_if<Kt::is_single && Vt::is_single, int>::type
-        add_to_value(KT* k, VT* v) {
-            value[k->get_value()] = v->get_value();
-            return 0;
-        }
-
-        template <typename Kt = KT, typename Vt = VT>
-        typename std::enable_if<Kt::is_single && !Vt::is_single, Vt*>::type
-        add_to_value(KT* k, VT* v) {
-            value[k->get_value()] = v;
-            return v;
-        }
-
-        template <typename Kt = KT, typename Vt = VT>
-        typename std::enable_if<!Kt::is_single && Vt::is_single, Kt*>::type
-        add_to_value(KT* k, VT* v) {
-            value[k] = v->get_value();
-            return k;
-        }
-
-        template <typename Kt = KT, typename Vt = VT>
-        typename std::enable_if<!Kt::is_single && !Vt::is_single, void>::type
-        add_to_value(KT* k, VT* v) {
-            value[k] = v;
-        }
+        storage_type value;
     };
 
 
@@ -433,6 +1372,63 @@ namespace detail {
     struct is_sequence_container<T,
             typename std::enable_if<is_list<T>::value || is_vector<T>::value || is_deque<T>::value>::type
     >: std::true_type{};
+
+    // Tuple, List and Map nodes, which live in an Arena
+    template <typename T, bool = std::is_base_of<_Base, T>::value>
+    struct is_compound_node: std::false_type {};
+
+    template <typename T>
+    struct is_compound_node<T, true>: std::integral_constant<bool, !T::is_single> {};
+
+    // Structs described with EIPP_RECORD, EIPP_NAMED_RECORD or
+    // EIPP_MAP_STRUCT; `type` is the description the macro generated, found
+    // through argument dependent lookup.
+    enum class StructKind {
+        Record,
+        Map
+    };
+
+    template <typename T>
+    struct described {
+        template <typename U>
+        static auto test(int) -> decltype(eipp_describe((const U*)nullptr));
+
+        template <typename U>
+        static void test(...);
+
+        typedef decltype(test<T>(0)) type;
+        static const bool value = !std::is_void<type>::value;
+    };
+
+    // Encoded size of types whose encoding never varies, 0 for the others.
+    template <typename T, typename = void>
+    struct fixed_term_size: std::integral_constant<size_t, 0> {};
+
+    template <typename T>
+    struct fixed_term_size<T, typename std::enable_if<std::is_floating_point<T>::value>::type>:
+            std::integral_constant<size_t, 9> {};     // NEW_FLOAT_EXT
+
+    template <typename T>
+    struct fixed_term_size<T, typename std::enable_if<is_one_of<T, bool, unsigned char>::value>::type>:
+            std::integral_constant<size_t, 2> {};     // SMALL_INTEGER_EXT
+
+    template <typename T, size_t N = std::tuple_size<T>::value>
+    struct fixed_elements_size {
+        typedef typename std::tuple_element<N - 1, T>::type last_type;
+        static constexpr size_t rest = fixed_elements_size<T, N - 1>::value;
+        static constexpr size_t last = fixed_term_size<last_type>::value;
+        static constexpr size_t value = (rest == 0 || last == 0) ? 0 : rest + last;
+    };
+
+    template <typename T>
+    struct fixed_elements_size<T, 1> {
+        static constexpr size_t value = fixed_term_size<typename std::tuple_element<0, T>::type>::value;
+    };
+
+    template <typename T>
+    struct fixed_term_size<T, typename std::enable_if<(std::tuple_size<T>::value > 0)>::type>:
+            std::integral_constant<size_t, fixed_elements_size<T>::value == 0 ? 0 :
+                    (std::tuple_size<T>::value <= 0xff ? 2 : 5) + fixed_elements_size<T>::value> {};
 }
 
 // simple type
@@ -442,6 +1438,11 @@ using String = detail::SingleType<TYPE::String, std::string, detail::StringDecod
 using Atom = detail::SingleType<TYPE::Atom, std::string, detail::AtomDecoder>;
 using Binary = detail::SingleType<TYPE::Binary, std::string, detail::BinaryDecoder>;
 
+// zero-copy views into the buffer given to EIDecoder
+using StringView = detail::SingleType<TYPE::String, ByteView, detail::StringViewDecoder>;
+using AtomView = detail::SingleType<TYPE::Atom, ByteView, detail::AtomViewDecoder>;
+using BinaryView = detail::SingleType<TYPE::Binary, ByteView, detail::BinaryViewDecoder>;
+
 
 // complex type
 template <typename ... Types>
@@ -450,332 +1451,3666 @@ using Tuple = detail::CompoundType<TYPE::Tuple, ei_decode_tuple_header, Types...
 template <typename T>
 using List = detail::SoleTypeListType<T>;
 
-template <typename KT, typename VT>
-using Map = detail::MapType<KT, VT>;
+// storage for decoded maps, see Map below
+struct SortedMapStorage {
+    template <typename K, typename V>
+    using type = detail::SortedMap<K, V>;
+};
 
-class EIDecoder {
-public:
-    EIDecoder(char* buf):
-            index_(0), version_(0), buf_(buf) {
-        ret_ = ei_decode_version(buf_, &index_, &version_);
+struct HashMapStorage {
+    template <typename K, typename V>
+    using type = detail::HashMap<K, V>;
+};
+
+template <typename KT, typename VT, typename Storage = SortedMapStorage>
+using Map = detail::MapType<KT, VT, Storage>;
+
+
+// Id of an atom in an AtomTable. Ids are handed out from 0 in interning
+// order, so the atoms a table is constructed with can be matched against an
+// enum. A default constructed id is invalid: the atom is not in the table.
+struct AtomId {
+    uint32_t value;
+
+    AtomId(): value(0xffffffff) {}
+    AtomId(uint32_t v): value(v) {}
+
+    bool valid() const {
+        return value != 0xffffffff;
     }
 
-    EIDecoder(const EIDecoder&) = delete;
-    EIDecoder&operator=(const EIDecoder&) = delete;
-    EIDecoder(EIDecoder&&) = delete;
+    friend bool operator == (AtomId a, AtomId b) {
+        return a.value == b.value;
+    }
 
-    ~EIDecoder() {
-        for(class detail::_Base* ptr: value_ptrs_) {
-            delete ptr;
-        }
+    friend bool operator != (AtomId a, AtomId b) {
+        return a.value != b.value;
     }
 
-    bool is_valid() const {
-        return ret_ == 0;
+    friend bool operator < (AtomId a, AtomId b) {
+        return a.value < b.value;
     }
+};
 
+// An atom term already encoded, see AtomTable::encoded(). EIEncoder copies
+// the bytes as they are.
+struct EncodedAtom {
+    ByteView bytes;
+};
 
-    template <typename T>
-    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::is_single, typename T::value_type>::type
-    parse() {
-        detail::_Base* t = new T();
-        ret_ = t->decode(buf_, &index_);
+// Interns atom names to AtomIds. Lookups compare the bytes found on the wire
+// and never allocate; each atom also keeps its encoded form so encoding it
+// is a plain copy. find() may be called from several threads at once as
+// long as nobody interns meanwhile.
+class AtomTable {
+public:
+    AtomTable() {}
 
-        value_ptrs_.push_back(t);
-        return dynamic_cast<T*>(t)->get_value();
+    // e.g. AtomTable{"ok", "error"} with enum {ok, error}
+    AtomTable(std::initializer_list<const char*> names) {
+        for(auto name: names) {
+            intern(ByteView(name));
+        }
     }
 
+    // names are referenced from the index, so the table stays put
+    AtomTable(const AtomTable&) = delete;
+    AtomTable&operator = (const AtomTable&) = delete;
 
-    template <typename T>
-    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && !T::is_single, T*>::type
-    parse() {
-        detail::_Base* t = new T();
-        ret_ = t->decode(buf_, &index_);
+    // id of `name`, added if missing; invalid if it is no valid atom name
+    AtomId intern(ByteView name) {
+        AtomId id = find(name);
+        if(id.valid()) return id;
 
-        value_ptrs_.push_back(t);
-        return dynamic_cast<T*>(t);
+        int size = 0;
+        if(ei_encode_atom_len(nullptr, &size, name.data(), (int)name.size()) != 0) {
+            return AtomId();
+        }
+
+        entries_.push_back(Entry());
+        Entry& entry = entries_.back();
+        entry.name = name.to_string();
+        entry.encoded.resize((size_t)size);
+        size = 0;
+        ei_encode_atom_len(&entry.encoded[0], &size, name.data(), (int)name.size());
+
+        id = AtomId((uint32_t)(entries_.size() - 1));
+        index_.emplace(ByteView(entry.name), id.value);
+        return id;
     }
 
+    // id of `name`, invalid when it was never interned
+    AtomId find(ByteView name) const {
+        auto it = index_.find(name);
+        return it == index_.end() ? AtomId() : AtomId(it->second);
+    }
 
-private:
-    int index_;
-    int version_;
-    int ret_;
-    const char* buf_;
-    std::vector<class detail::_Base*> value_ptrs_;
+    ByteView name(AtomId id) const {
+        if(id.value >= entries_.size()) return ByteView();
+        return ByteView(entries_[id.value].name);
+    }
 
-};
+    EncodedAtom encoded(AtomId id) const {
+        EncodedAtom atom;
+        if(id.value < entries_.size()) {
+            atom.bytes = ByteView(entries_[id.value].encoded);
+        }
+        return atom;
+    }
 
+    size_t size() const {
+        return entries_.size();
+    }
 
-class EIEncoder {
 private:
-    struct XBuffWrapper;
-
-public:
-    EIEncoder(): ret_(0) {
-        base_buff_ = new XBuffWrapper();
+    struct Entry {
+        std::string name;
+        std::string encoded;
+    };
 
-        ret_ = ei_x_new_with_version(base_buff_->x_buff);
-        base_buff_->keep();
-        if(ret_!=0) return;
+    std::deque<Entry> entries_;     // a deque never moves its elements
+    std::unordered_map<ByteView, uint32_t, detail::KeyHash<ByteView>> index_;
+};
 
-        x_buff_stack_.push(base_buff_);
+namespace detail {
+    inline bool type_of_tag(char tag, TYPE* tp) {
+        switch(tag) {
+            case ERL_SMALL_INTEGER_EXT:
+            case ERL_INTEGER_EXT:
+            case ERL_SMALL_BIG_EXT:
+            case ERL_LARGE_BIG_EXT:
+                *tp = TYPE::Integer;
+                return true;
+            case NEW_FLOAT_EXT:
+            case ERL_FLOAT_EXT:
+                *tp = TYPE::Float;
+                return true;
+            case ERL_STRING_EXT:
+                *tp = TYPE::String;
+                return true;
+            case ERL_BINARY_EXT:
+                *tp = TYPE::Binary;
+                return true;
+            case ERL_ATOM_EXT:
+            case ERL_SMALL_ATOM_EXT:
+            case ERL_ATOM_UTF8_EXT:
+            case ERL_SMALL_ATOM_UTF8_EXT:
+                *tp = TYPE::Atom;
+                return true;
+            case ERL_LIST_EXT:
+            case ERL_NIL_EXT:
+                *tp = TYPE::List;
+                return true;
+            case ERL_SMALL_TUPLE_EXT:
+            case ERL_LARGE_TUPLE_EXT:
+                *tp = TYPE::Tuple;
+                return true;
+            case ERL_MAP_EXT:
+                *tp = TYPE::Map;
+                return true;
+            default:
+                return false;
+        }
     }
+}
 
-    EIEncoder(const EIEncoder&) = delete;
-    EIEncoder&operator = (const EIEncoder&) = delete;
-    EIEncoder(EIEncoder&&) = delete;
 
-    ~EIEncoder() {
-        while(!x_buff_stack_.empty()) {
-            auto* buf = x_buff_stack_.top();
-            delete buf;
-            x_buff_stack_.pop();
+// Lazy, read-only position in an encoded term. Nothing is decoded or
+// allocated until a value is asked for; siblings are stepped over with
+// ei_skip_term. Valid as long as the buffer lives.
+class TermCursor {
+public:
+    TermCursor(): buf_(nullptr), index_(0), type_(TYPE::Integer), valid_(false) {}
+
+    // the term of a whole message, after its version byte
+    explicit TermCursor(const char* buf): TermCursor() {
+        if((unsigned char)buf[0] == ERL_VERSION_MAGIC) {
+            reset(buf, 1);
         }
     }
 
-    // list, vector, deque
-    template <typename T>
-    typename std::enable_if<detail::is_sequence_container<T>::value>::type
-    encode(const T& arg) {
-        auto arity = arg.size();
-        if(arity == 0) {
-            auto* buff = current_buff();
-            buff->keep();
-            ret_ = ei_x_encode_empty_list(buff->x_buff);
-            buff->keep();
-            return;
-        }
+    // the term starting at buf + index
+    TermCursor(const char* buf, int index): TermCursor() {
+        reset(buf, index);
+    }
 
-        auto header_func = [this, &arity](XBuffWrapper* this_buff) {
-            this_buff->keep();
-            this->ret_ = ei_x_encode_list_header(this_buff->x_buff, arity);
-            this_buff->keep();
-        };
+    bool valid() const {
+        return valid_;
+    }
 
-        CompoundEncoder en(this, header_func);
+    TYPE type() const {
+        return type_;
+    }
 
-        for(auto& element: arg) {
-            encode(element);
-        }
+    const char* buffer() const {
+        return buf_;
+    }
 
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_empty_list(buff->x_buff);
-        buff->keep();
+    int index() const {
+        return index_;
     }
 
-    // tuple
-    template <typename T>
-    typename std::enable_if<std::tuple_size<T>::value >= 0 >::type
-    encode(const T& arg) {
-        constexpr size_t arity = std::tuple_size<T>::value;
-        if(arity == 0) {
-            auto* buff = current_buff();
-            buff->keep();
-            ret_ = ei_x_encode_tuple_header(buff->x_buff, 0);
-            buff->keep();
-            return;
+    // elements of a tuple or list, pairs of a map, bytes of a string; a
+    // list written in chunks counts them all, which steps over its elements
+    size_t arity() const {
+        if(!valid_) return 0;
+
+        int tp = 0, len = 0;
+        ei_get_type(buf_, &index_, &tp, &len);
+        if(tp == ERL_LIST_EXT) {
+            size_t total = 0;
+            for_each_chunk([&total](int, int n) {
+                total += (size_t)n;
+                return false;
+            });
+            return total;
         }
 
-        auto header_func = [this, &arity](XBuffWrapper* this_buff) {
-            this_buff->keep();
-            this->ret_ = ei_x_encode_tuple_header(this_buff->x_buff, arity);
-            this_buff->keep();
-        };
+        return tp == ERL_NIL_EXT ? 0 : (size_t)len;
+    }
 
-        CompoundEncoder en(this, header_func);
-        TupleEncoderHelper<arity, T>::encode(this, arg);
+    // bytes the term takes in the buffer
+    size_t encoded_size() const {
+        int end = index_;
+        if(!valid_ || ei_skip_term(buf_, &end) != 0) return 0;
+        return (size_t)(end - index_);
     }
 
-    // map
-    template <typename T>
-    typename std::enable_if<
-            std::is_same<typename T::value_type, std::pair<const typename T::key_type, typename T::mapped_type>>::value>::type
-    encode(const T& arg) {
-        auto arity = arg.size();
-        if(arity == 0) {
-            auto* buff = current_buff();
-            buff->keep();
-            ret_ = ei_x_encode_map_header(buff->x_buff, 0);
-            buff->keep();
-            return;
-        }
+    // the term right after this one; the buffer must hold one, as for a
+    // sibling inside a tuple, list or map
+    TermCursor next() const {
+        int end = index_;
+        if(!valid_ || ei_skip_term(buf_, &end) != 0) return TermCursor();
+        return TermCursor(buf_, end);
+    }
 
-        auto header_func = [this, &arity](XBuffWrapper* this_buff) {
-            this_buff->keep();
-            this->ret_ = ei_x_encode_map_header(this_buff->x_buff, arity);
-            this_buff->keep();
-        };
+    // element `i` of a tuple or list (not of a byte string, which has no
+    // separate element terms; read it with get_string())
+    TermCursor child(size_t i) const {
+        if(valid_ && type_ == TYPE::List) {
+            TermCursor found;
+            for_each_chunk([&](int index, int n) {
+                if(i < (size_t)n) {
+                    found = TermCursor(buf_, index).skip(i);
+                    return true;
+                }
 
-        CompoundEncoder en(this, header_func);
+                i -= (size_t)n;
+                return false;
+            });
+            return found;
+        }
 
-        for(auto& iter: arg) {
-            encode(iter.first);
-            encode(iter.second);
+        if(!valid_ || type_ != TYPE::Tuple || i >= arity()) {
+            return TermCursor();
         }
-    };
 
-    // integral
-    template <typename T>
-    typename std::enable_if<std::is_integral<T>::value>::type
-    encode(const T& arg) {
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_long(buff->x_buff, (long)arg);
-        buff->keep();
+        return first_child().skip(i);
     }
 
-    // double
-    template <typename T>
-    typename std::enable_if<std::is_floating_point<T>::value>::type
-    encode(const T& arg) {
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_double(buff->x_buff, (double)arg);
-        buff->keep();
+    // key and value of map entry `i`
+    TermCursor map_key(size_t i) const {
+        if(!valid_ || type_ != TYPE::Map || i >= arity()) return TermCursor();
+        return first_child().skip(2 * i);
     }
 
-    // atom
-    template <typename T>
-    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::category_type == TYPE::Atom>::type
-    encode(const T& arg) {
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_atom_len(buff->x_buff, arg.value.c_str(), (int)arg.value.length());
-        buff->keep();
-    };
+    TermCursor map_value(size_t i) const {
+        if(!valid_ || type_ != TYPE::Map || i >= arity()) return TermCursor();
+        return first_child().skip(2 * i + 1);
+    }
 
-    // binary
-    template <typename T>
-    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::category_type == TYPE::Binary>::type
-    encode(const T& arg) {
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_binary(buff->x_buff, arg.value.c_str(), (int)arg.value.length());
-        buff->keep();
-    };
+    // value stored under an atom, binary or string key equal to `key`
+    TermCursor find_map_key(ByteView key) const {
+        return find_map_key_if([&key](const TermCursor& k) {
+            ByteView v;
+            return (k.get_atom(v) || k.get_binary(v) || k.get_string(v)) && v == key;
+        });
+    }
 
-    // string
-    template <typename T>
-    typename std::enable_if<detail::is_one_of<T, char *, unsigned char *>::value>::type
-    encode(const T& arg) {
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_string(buff->x_buff, arg);
-        buff->keep();
-    };
+    TermCursor find_map_key(const char* key) const {
+        return find_map_key(ByteView(key));
+    }
 
-    template <typename T>
-    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::category_type == TYPE::String>::type
-    encode(const T& arg) {
-        encode(arg.get_value());
-    };
+    // value stored under an integer key
+    TermCursor find_map_key(long key) const {
+        return find_map_key_if([key](const TermCursor& k) {
+            long v = 0;
+            return k.get_long(v) && v == key;
+        });
+    }
 
-    void
-    encode(const std::string& arg) {
-        auto* buff = current_buff();
-        buff->keep();
-        ret_ = ei_x_encode_string_len(buff->x_buff, arg.c_str(), (int)arg.length());
-        buff->keep();
+    bool get_long(long& value) const {
+        int index = index_;
+        return valid_ && type_ == TYPE::Integer && ei_decode_long(buf_, &index, &value) == 0;
     }
 
-    bool is_valid() const {
-        return ret_ == 0;
+    bool get_double(double& value) const {
+        int index = index_;
+        return valid_ && type_ == TYPE::Float && ei_decode_double(buf_, &index, &value) == 0;
     }
 
-    std::string get_data() {
-        if(ret_!=0) {
-            return std::string();
+    bool get_atom(ByteView& value) const {
+        int index = index_;
+        return valid_ && type_ == TYPE::Atom && detail::AtomViewDecoder()(buf_, &index, value, nullptr) == 0;
+    }
+
+    bool get_binary(ByteView& value) const {
+        int index = index_;
+        return valid_ && type_ == TYPE::Binary && detail::BinaryViewDecoder()(buf_, &index, value, nullptr) == 0;
+    }
+
+    // STRING_EXT, or [] as the empty string
+    bool get_string(ByteView& value) const {
+        if(!valid_) return false;
+
+        const char* s = buf_ + index_;
+        if(*s == ERL_NIL_EXT) {
+            value = ByteView();
+            return true;
         }
 
-        std::string s(base_buff_->x_buff->buff, (unsigned long)base_buff_->x_buff->index);
-        return s;
+        if(*s != ERL_STRING_EXT) return false;
+        value = ByteView(s + 3, detail::get_be16(s + 1));
+        return true;
+    }
+
+    // Follow a dot separated path such as "3.key.0": a number picks the
+    // element of a tuple or list (from 0), in a map each part is looked up
+    // as an integer key, then as an atom, binary or string key.
+    TermCursor at(const char* path) const {
+        TermCursor cursor = *this;
+
+        while(*path && cursor.valid()) {
+            const char* end = path;
+            while(*end && *end != '.') end++;
+
+            ByteView part(path, (size_t)(end - path));
+            long number = 0;
+            bool is_number = parse_long(part, &number);
+
+            if(cursor.type_ == TYPE::Map) {
+                TermCursor found = is_number ? cursor.find_map_key(number) : TermCursor();
+                cursor = found.valid() ? found : cursor.find_map_key(part);
+            } else if(is_number && number >= 0) {
+                cursor = cursor.child((size_t)number);
+            } else {
+                cursor = TermCursor();
+            }
+
+            path = *end ? end + 1 : end;
+        }
+
+        return cursor;
+    }
+
+    // the atom's name, empty when this is not an atom; handy for routing
+    ByteView atom() const {
+        ByteView value;
+        get_atom(value);
+        return value;
+    }
+
+    // the atom's id in `table`, invalid when this is not an atom or the
+    // table does not know it
+    AtomId atom_id(const AtomTable& table) const {
+        ByteView value;
+        return get_atom(value) ? table.find(value) : AtomId();
     }
 
 private:
-    struct XBuffWrapper {
-        ei_x_buff* x_buff;
-        char* orig_char_buff;
+    void reset(const char* buf, int index) {
+        buf_ = buf;
+        index_ = index;
+        valid_ = detail::type_of_tag(buf[index], &type_);
+    }
+
+    TermCursor first_child() const {
+        int index = index_;
+        int arity = 0;
+        if(type_ == TYPE::Tuple) {
+            ei_decode_tuple_header(buf_, &index, &arity);
+        } else if(type_ == TYPE::List) {
+            ei_decode_list_header(buf_, &index, &arity);
+        } else {
+            ei_decode_map_header(buf_, &index, &arity);
+        }
+
+        return TermCursor(buf_, index);
+    }
+
+    // A list goes on in a list at its tail when it was written in chunks
+    // (see StreamEncoder), as SoleTypeListType::decode follows it. Calls
+    // f(index of the first element, elements) per chunk until f returns
+    // true or the tail is [] or not a list.
+    template <typename F>
+    void for_each_chunk(F f) const {
+        int index = index_;
+        while(buf_[index] == ERL_LIST_EXT) {
+            int n = 0;
+            if(ei_decode_list_header(buf_, &index, &n) != 0 || f(index, n)) return;
+
+            for(int i = 0; i < n; i++) {
+                if(ei_skip_term(buf_, &index) != 0) return;
+            }
+        }
+    }
 
-        XBuffWrapper() {
-            x_buff = new ei_x_buff();
-            x_buff->buff = nullptr;
-            orig_char_buff = nullptr;
+    TermCursor skip(size_t n) const {
+        int index = index_;
+        for(size_t i = 0; i < n; i++) {
+            if(ei_skip_term(buf_, &index) != 0) return TermCursor();
         }
 
-        ~XBuffWrapper() {
-            if(orig_char_buff) free(orig_char_buff);
-            delete x_buff;
+        return TermCursor(buf_, index);
+    }
+
+    static bool parse_long(ByteView s, long* value) {
+        size_t i = (!s.empty() && s[0] == '-') ? 1 : 0;
+        if(i == s.size()) return false;
+
+        long v = 0;
+        for(; i < s.size(); i++) {
+            if(s[i] < '0' || s[i] > '9') return false;
+
+            long digit = s[i] - '0';
+            if(v > (std::numeric_limits<long>::max() - digit) / 10) return false;
+            v = v * 10 + digit;
         }
 
-        void keep() {
-            if(x_buff->buff) {
-                orig_char_buff = x_buff->buff;
+        *value = s[0] == '-' ? -v : v;
+        return true;
+    }
+
+    template <typename F>
+    TermCursor find_map_key_if(F match) const {
+        size_t arity = type_ == TYPE::Map ? this->arity() : 0;
+
+        TermCursor key = valid_ && arity > 0 ? first_child() : TermCursor();
+        for(size_t i = 0; i < arity && key.valid(); i++) {
+            TermCursor value = key.next();
+            if(match(key)) {
+                return value;
+            }
+
+            if(i + 1 < arity) {
+                key = value.next();
             }
         }
-    };
 
+        return TermCursor();
+    }
 
-    struct CompoundEncoder {
-        EIEncoder* encoder;
-        std::function<void(XBuffWrapper*)> header_func;
+    const char* buf_;
+    int index_;
+    TYPE type_;
+    bool valid_;
+};
+
+
+class EIDecoder {
+public:
+    // Decoded nodes are carved out of `arena`. Without one the decoder uses
+    // its own Arena and everything it returned dies with it; with a caller
+    // supplied Arena the results live until that Arena is reset().
+    EIDecoder(const char* buf, Arena* arena = nullptr):
+            index_(0), version_(0), buf_(buf), arena_(arena ? arena : &own_arena_), atoms_(nullptr) {
+        ret_ = ei_decode_version(buf_, &index_, &version_);
+        if(ret_ == 0 && buf_[index_] == detail::compressed_tag) {
+            ret_ = -1;      // the zlib stream can only be read knowing its size
+        }
+    }
+
+    // Knowing the size of the input, compressed terms are accepted as well
+    // (with EIPP_WITH_ZLIB). They are inflated into the Arena once and
+    // decoded from there, so views point into the Arena instead of `buf`.
+    // Input over 2 GiB is refused: ei indexes into it with an int.
+    EIDecoder(const char* buf, size_t size, Arena* arena = nullptr): EIDecoder(buf, arena) {
+        if(size > (size_t)std::numeric_limits<int>::max()) {
+            ret_ = -1;
+        } else if(size > detail::compressed_header_size &&
+                (unsigned char)buf[0] == ERL_VERSION_MAGIC && buf[1] == detail::compressed_tag) {
+            ret_ = inflate_term(buf, size);
+        }
+    }
+
+    // decode just the term under `cursor`
+    explicit EIDecoder(const TermCursor& cursor, Arena* arena = nullptr):
+            index_(cursor.index()), version_(0), buf_(cursor.buffer()), arena_(arena ? arena : &own_arena_),
+            atoms_(nullptr) {
+        ret_ = cursor.valid() ? 0 : -1;
+    }
+
+    EIDecoder(const EIDecoder&) = delete;
+    EIDecoder&operator=(const EIDecoder&) = delete;
+    EIDecoder(EIDecoder&&) = delete;
+
+    bool is_valid() const {
+        return ret_ == 0;
+    }
+
+    // the table AtomId values are looked up in
+    void set_atom_table(const AtomTable* table) {
+        atoms_ = table;
+    }
 
-        CompoundEncoder(EIEncoder* _en, std::function<void(XBuffWrapper*)> _func): encoder(_en), header_func(_func) {
-            XBuffWrapper* sub_buff = new XBuffWrapper();
-            encoder->ret_ = ei_x_new(sub_buff->x_buff);
-            sub_buff->keep();
-            encoder->x_buff_stack_.push(sub_buff);
+
+    template <typename T>
+    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::is_single, typename T::value_type>::type
+    parse() {
+        uint64_t start = detail::stats_clock();
+        int begin = index_;
+        T t;
+        ret_ = t.decode(buf_, &index_, arena_);
+        if(ret_ == 0) detail::stats_term(false, (size_t)(index_ - begin), start);
+        return std::move(t.get_value());
+    }
+
+
+    template <typename T>
+    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && !T::is_single, T*>::type
+    parse() {
+        uint64_t start = detail::stats_clock();
+        int begin = index_;
+        T* t = detail::new_node<T>(arena_);
+        ret_ = t->decode(buf_, &index_, arena_);
+        if(ret_ == 0) detail::stats_term(false, (size_t)(index_ - begin), start);
+        return t;
+    }
+
+
+    // Statically typed decoding, the mirror image of EIEncoder::encode: the
+    // same plain C++ types are accepted and every step is resolved at
+    // compile time.
+    template <typename T>
+    T decode() {
+        uint64_t start = detail::stats_clock();
+        int begin = index_;
+        T value;
+        decode_into(value);
+        if(ret_ == 0) detail::stats_term(false, (size_t)(index_ - begin), start);
+        return value;
+    }
+
+    // list, vector, deque
+    template <typename T>
+    typename std::enable_if<detail::is_sequence_container<T>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        int tp = 0, arity = 0;
+        ret_ = ei_get_type(buf_, &index_, &tp, &arity);
+        if(ret_ != 0) return;
+
+        // Erlang sends a list of small integers as a byte string
+        if(tp == ERL_STRING_EXT) {
+            detail::stats_nodes(TYPE::List);
+            ret_ = decode_byte_string(arg);
+            return;
         }
 
-        ~CompoundEncoder() {
-            auto* sub_buff = encoder->x_buff_stack_.top();
-            encoder->x_buff_stack_.pop();
-            auto* prev_buff = encoder->current_buff();
+        ret_ = ei_decode_list_header(buf_, &index_, &arity);
+        if(ret_ != 0) return;
+        detail::stats_nodes(TYPE::List);
 
-            header_func(prev_buff);
+        arg.resize((size_t)arity);
+        decode_elements(arg, arg.begin());
 
-            prev_buff->keep();
-            encoder->ret_ = ei_x_append(prev_buff->x_buff, sub_buff->x_buff);
-            prev_buff->keep();
+        // a list whose tail is another list, as StreamEncoder writes them,
+        // goes on there
+        while(ret_ == 0 && arity != 0 && buf_[index_] == ERL_LIST_EXT) {
+            size_t from = arg.size();
+            ret_ = ei_decode_list_header(buf_, &index_, &arity);
+            if(ret_ != 0) return;
 
-            delete sub_buff;
+            arg.resize(from + (size_t)arity);
+            decode_elements(arg, std::next(arg.begin(), (std::ptrdiff_t)from));
         }
 
-    };
+        if(ret_ != 0 || arity == 0) return;
+        decode_list_tail();
+    }
+
+    // tuple
+    template <typename T>
+    typename std::enable_if<std::tuple_size<T>::value >= 0 >::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        constexpr size_t arity = std::tuple_size<T>::value;
+        int size = 0;
+        ret_ = ei_decode_tuple_header(buf_, &index_, &size);
+        if(ret_ != 0) return;
+
+        if(size != (int)arity) {
+            ret_ = -1;
+            return;
+        }
+        detail::stats_nodes(TYPE::Tuple);
+
+        TupleDecoderHelper<arity, T>::decode(this, arg);
+    }
+
+    // map
+    template <typename T>
+    typename std::enable_if<
+            std::is_same<typename T::value_type, std::pair<const typename T::key_type, typename T::mapped_type>>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        int begin = index_, arity = 0;
+        ret_ = ei_decode_map_header(buf_, &index_, &arity);
+        if(ret_ != 0) return;
+        detail::stats_nodes(TYPE::Map);
+
+        // The keys of a map decoded before are most likely the keys of this
+        // one: their values are decoded in place, keeping their nodes and
+        // whatever memory the values hold.
+        typename T::key_type key = typename T::key_type();
+        for(int i = 0; i < arity && ret_ == 0; i++) {
+            decode_into(key);
+            if(ret_ != 0) return;
+
+            auto it = arg.find(key);
+            if(it == arg.end()) it = arg.emplace(key, typename T::mapped_type()).first;
+            decode_into(it->second);
+        }
+        if(ret_ != 0 || arg.size() == (size_t)arity) return;
+
+        // some keys were not in this map: start over
+        index_ = begin;
+        ret_ = ei_decode_map_header(buf_, &index_, &arity);
+        arg.clear();
+        for(int i = 0; i < arity && ret_ == 0; i++) {
+            typename T::key_type key = typename T::key_type();
+            typename T::mapped_type value = typename T::mapped_type();
+            decode_into(key);
+            decode_into(value);
+            arg.emplace(std::move(key), std::move(value));
+        }
+    }
+
+    // integral
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        long value = 0;
+        ret_ = ei_decode_long(buf_, &index_, &value);
+        detail::stats_nodes(TYPE::Integer);
+        if(ret_ == 0 && (value < (long)std::numeric_limits<T>::min() || value > (long)std::numeric_limits<T>::max())) {
+            ret_ = -1;
+        }
+        arg = (T)value;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        unsigned long value = 0;
+        ret_ = ei_decode_ulong(buf_, &index_, &value);
+        detail::stats_nodes(TYPE::Integer);
+        if(ret_ == 0 && value > (unsigned long)std::numeric_limits<T>::max()) {
+            ret_ = -1;
+        }
+        arg = (T)value;
+    }
+
+    // double
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        double value = 0;
+        ret_ = ei_decode_double(buf_, &index_, &value);
+        detail::stats_nodes(TYPE::Float);
+        arg = (T)value;
+    }
+
+    // Long, Double, String, Atom, Binary and the views
+    template <typename T>
+    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::is_single>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+        ret_ = typename T::decoder_type()(buf_, &index_, arg.value, arena_);
+        detail::stats_nodes(T::category_type);
+    }
+
+    // Tuple, List and Map, typically a tree parse() returned for an earlier
+    // message of the same shape: its nodes, strings and list and map storage
+    // are decoded again in place, so a steady stream stops allocating. Nodes
+    // the tree lacks come from this decoder's Arena, which must be the one
+    // the tree was parsed into, and not reset since.
+    template <typename T>
+    typename std::enable_if<detail::is_compound_node<T>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+        ret_ = arg.T::decode(buf_, &index_, arena_);
+    }
+
+    // string
+    void
+    decode_into(std::string& arg) {
+        if(ret_ != 0) return;
+        ret_ = detail::StringDecoder()(buf_, &index_, arg, arena_);
+        detail::stats_nodes(TYPE::String);
+    }
+
+    void
+    decode_into(Skip&) {
+        if(ret_ != 0) return;
+        ret_ = ei_skip_term(buf_, &index_);
+    }
+
+    // struct described with EIPP_RECORD or EIPP_MAP_STRUCT
+    template <typename T>
+    typename std::enable_if<detail::described<T>::value>::type
+    decode_into(T& arg) {
+        if(ret_ != 0) return;
+
+        typedef typename detail::described<T>::type info;
+        int arity = 0;
+        if(info::kind() == detail::StructKind::Record) {
+            ret_ = ei_decode_tuple_header(buf_, &index_, &arity);
+            if(ret_ != 0) return;
+
+            ByteView tag;
+            if(arity != (int)info::size + 1 || detail::AtomViewDecoder()(buf_, &index_, tag, arena_) != 0 ||
+                    tag != ByteView(info::name(), info::name_size())) {
+                ret_ = -1;
+                return;
+            }
+            detail::stats_nodes(TYPE::Tuple);
+
+            FieldDecoder visitor = {this};
+            info::each(arg, visitor);
+            return;
+        }
+
+        ret_ = ei_decode_map_header(buf_, &index_, &arity);
+        if(ret_ != 0) return;
+        detail::stats_nodes(TYPE::Map);
+
+        size_t next = 0;    // where the field of the next key probably is
+        for(int i = 0; i < arity && ret_ == 0; i++) {
+            FieldFinder finder = {this, ByteView(), next, 0, false};
+            if(buf_[index_] == ERL_SMALL_ATOM_UTF8_EXT || buf_[index_] == ERL_ATOM_UTF8_EXT ||
+                    buf_[index_] == ERL_SMALL_ATOM_EXT || buf_[index_] == ERL_ATOM_EXT) {
+                ret_ = detail::AtomViewDecoder()(buf_, &index_, finder.key, arena_);
+                if(ret_ == 0) info::each(arg, finder);
+                if(ret_ == 0 && !finder.found && next > 0) {
+                    finder.from = finder.at = 0;
+                    info::each(arg, finder);
+                }
+            } else {
+                ret_ = ei_skip_term(buf_, &index_);
+            }
+
+            // not one of the fields
+            if(!finder.found && ret_ == 0) ret_ = ei_skip_term(buf_, &index_);
+            next = finder.found ? finder.from : next;
+        }
+    }
+
+    // an atom unknown to the table gives an invalid id, not an error
+    void
+    decode_into(AtomId& arg) {
+        if(ret_ != 0) return;
+        if(atoms_ == nullptr) {
+            ret_ = -1;
+            return;
+        }
+
+        ByteView name;
+        ret_ = detail::AtomViewDecoder()(buf_, &index_, name, arena_);
+        detail::stats_nodes(TYPE::Atom);
+        arg = ret_ == 0 ? atoms_->find(name) : AtomId();
+    }
 
 
+private:
     template<int N, typename T>
-    struct TupleEncoderHelper;
+    struct TupleDecoderHelper;
 
     template<int N, typename T>
-    struct TupleEncoderHelper {
-        static void encode(EIEncoder* encoder, const T& tuple) {
+    struct TupleDecoderHelper {
+        static void decode(EIDecoder* decoder, T& tuple) {
             constexpr auto index = std::tuple_size<T>::value - N;
             auto& element = std::get<index>(tuple);
-            encoder->encode(element);
-            TupleEncoderHelper<N-1, T>::encode(encoder, tuple);
+            decoder->decode_into(element);
+            TupleDecoderHelper<N-1, T>::decode(decoder, tuple);
         }
     };
 
     template <typename T>
-    struct TupleEncoderHelper<0, T> {
-        static void encode(EIEncoder*, const T&) {
+    struct TupleDecoderHelper<0, T> {
+        static void decode(EIDecoder*, T&) {
         }
     };
 
-    int ret_;
-    XBuffWrapper* base_buff_;
-    std::stack<XBuffWrapper*> x_buff_stack_;
+    // the fields of a record, in order
+    struct FieldDecoder {
+        EIDecoder* decoder;
+
+        template <typename V>
+        bool operator()(const char*, size_t, V& field) {
+            decoder->decode_into(field);
+            return decoder->ret_ == 0;
+        }
+    };
+
+    // The field named `key` of a map, from field `from` on; a map encoded
+    // from the same struct has its keys in field order, so the field after
+    // the last one found is tried first.
+    struct FieldFinder {
+        EIDecoder* decoder;
+        ByteView key;
+        size_t from;
+        size_t at;
+        bool found;
+
+        template <typename V>
+        bool operator()(const char* name, size_t len, V& field) {
+            size_t i = at++;
+            if(i < from || key != ByteView(name, len)) return true;
+
+            decoder->decode_into(field);
+            found = true;
+            from = i + 1;
+            return false;
+        }
+    };
+
+    // numeric vectors are contiguous and take the bulk path
+    template <typename T, typename E = typename T::value_type>
+    typename std::enable_if<detail::is_vector<T>::value && detail::ListRun<E>::bulk>::type
+    decode_elements(T& arg, typename T::iterator first) {
+        size_t n = arg.size();
+        for(size_t i = (size_t)(first - arg.begin()); i < n && ret_ == 0; ) {
+            i += detail::ListRun<E>::decode(buf_, &index_, arg.data() + i, n - i);
+            if(i < n) decode_into(arg[i++]);
+        }
+    }
+
+    template <typename T, typename E = typename T::value_type>
+    typename std::enable_if<!(detail::is_vector<T>::value && detail::ListRun<E>::bulk)>::type
+    decode_elements(T& arg, typename T::iterator first) {
+        for(; first != arg.end(); ++first) {
+            decode_into(*first);
+        }
+    }
+
+    template <typename T, typename E = typename T::value_type>
+    typename std::enable_if<detail::is_vector<T>::value && std::is_integral<E>::value && detail::ListRun<E>::bulk, int>::type
+    decode_byte_string(T& arg) {
+        const char* s = buf_ + index_;
+        size_t len = detail::get_be16(s + 1);
+
+        arg.resize(len);
+        if(!detail::ListRun<E>::decode_bytes(s + 3, len, arg.data())) return -1;
+
+        index_ += 3 + (int)len;
+        return 0;
+    }
+
+    template <typename T, typename E = typename T::value_type>
+    typename std::enable_if<std::is_integral<E>::value && !(detail::is_vector<T>::value && detail::ListRun<E>::bulk), int>::type
+    decode_byte_string(T& arg) {
+        const char* s = buf_ + index_;
+        size_t len = detail::get_be16(s + 1);
+        s += 3;
+
+        // the same range check as the bulk path
+        for(size_t i = 0; i < len; i++) {
+            if((uint64_t)(unsigned char)s[i] > (uint64_t)std::numeric_limits<E>::max()) return -1;
+        }
+
+        arg.resize(len);
+        for(auto& element: arg) {
+            element = (E)(unsigned char)*s++;
+        }
+
+        index_ += 3 + (int)len;
+        return 0;
+    }
+
+    template <typename T, typename E = typename T::value_type>
+    typename std::enable_if<!std::is_integral<E>::value, int>::type
+    decode_byte_string(T&) {
+        return -1;
+    }
+
+    void decode_list_tail() {
+        int tail = 0;
+        ret_ = ei_decode_list_header(buf_, &index_, &tail);
+        if(ret_ == 0 && tail != 0) {
+            ret_ = -1;
+        }
+    }
+
+#ifdef EIPP_WITH_ZLIB
+    int inflate_term(const char* buf, size_t size) {
+        uint32_t len = detail::get_be32(buf + 2);
+        size_t in = size - detail::compressed_header_size;
+        if(in > std::numeric_limits<uInt>::max() || len >= (uint32_t)std::numeric_limits<int>::max() ||
+                (uint64_t)len > (uint64_t)in * detail::max_inflate_ratio + 64) {
+            return -1;
+        }
+
+        char* out = static_cast<char*>(arena_->allocate((size_t)len + 1, 1));
+        out[0] = (char)ERL_VERSION_MAGIC;
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(inflateInit(&zs) != Z_OK) return -1;
+
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf + detail::compressed_header_size));
+        zs.avail_in = (uInt)in;
+        zs.next_out = reinterpret_cast<Bytef*>(out + 1);
+        zs.avail_out = (uInt)len;
+
+        bool ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == len;
+        inflateEnd(&zs);
+        if(!ok) return -1;
 
-    XBuffWrapper* current_buff() {
-        return x_buff_stack_.top();
+        buf_ = out;
+        index_ = 1;
+        return 0;
+    }
+#else
+    int inflate_term(const char*, size_t) {
+        return -1;
     }
+#endif
 
+    int index_;
+    int version_;
+    int ret_;
+    const char* buf_;
+    Arena own_arena_;
+    Arena* arena_;
+    const AtomTable* atoms_;
 };
 
 
-}
+// A term of any shape, for messages whose schema is not known up front.
+// The whole term is decoded once into a flat array of nodes. The children of
+// a tuple, list or map sit in consecutive nodes (the keys and values of a
+// map alternate). Integers, floats and atoms of up to 8 bytes are held in
+// their node; strings, binaries and longer atoms are views into the buffer.
+// Every node knows where its term starts in the buffer, so any part can be
+// handed to EIDecoder for typed decoding with decode_into() or parse().
+// Terms outside TYPE (pids, references, funs), improper lists and integers
+// that do not fit a long are not accepted. Valid as long as the buffer lives.
+class Term {
+private:
+    struct Node {
+        TYPE type;
+        uint32_t size;      // elements, map pairs or bytes
+        int offset;         // where the term starts in the buffer
+        union {
+            long integer;
+            double number;
+            const char* data;
+            uint32_t first;     // node of the first child
+            char bytes[8];      // short atoms
+        } value;
+    };
+
+public:
+    // One node of a Term; a default constructed Ref is invalid, and so is
+    // every Ref asked for with the wrong type or an index out of range.
+    class Ref {
+    public:
+        Ref(): term_(nullptr), node_(0) {}
+
+        bool valid() const {
+            return term_ != nullptr;
+        }
+
+        TYPE type() const {
+            return node().type;
+        }
+
+        bool is(TYPE type) const {
+            return valid() && node().type == type;
+        }
+
+        // elements of a tuple or list, pairs of a map, bytes of a string,
+        // binary or atom
+        size_t size() const {
+            return valid() ? node().size : 0;
+        }
+
+        // element `i` of a tuple or list
+        Ref operator[] (size_t i) const {
+            if(!(is(TYPE::Tuple) || is(TYPE::List)) || i >= node().size) return Ref();
+            return Ref(term_, node().value.first + (uint32_t)i);
+        }
+
+        // key and value of map entry `i`
+        Ref key(size_t i) const {
+            if(!is(TYPE::Map) || i >= node().size) return Ref();
+            return Ref(term_, node().value.first + 2 * (uint32_t)i);
+        }
+
+        Ref value(size_t i) const {
+            if(!is(TYPE::Map) || i >= node().size) return Ref();
+            return Ref(term_, node().value.first + 2 * (uint32_t)i + 1);
+        }
+
+        // value stored under an atom, binary or string key equal to `key`
+        Ref find(ByteView key) const {
+            for(size_t i = 0; i < size() && is(TYPE::Map); i++) {
+                Ref k = this->key(i);
+                if((k.is(TYPE::Atom) || k.is(TYPE::Binary) || k.is(TYPE::String)) && k.bytes() == key) return value(i);
+            }
+            return Ref();
+        }
+
+        Ref find(const char* key) const {
+            return find(ByteView(key));
+        }
+
+        // value stored under an integer key
+        Ref find(long key) const {
+            long k = 0;
+            for(size_t i = 0; i < size() && is(TYPE::Map); i++) {
+                if(this->key(i).get_long(k) && k == key) return value(i);
+            }
+            return Ref();
+        }
+
+        bool get_long(long& value) const {
+            if(!is(TYPE::Integer)) return false;
+            value = node().value.integer;
+            return true;
+        }
+
+        bool get_double(double& value) const {
+            if(!is(TYPE::Float)) return false;
+            value = node().value.number;
+            return true;
+        }
+
+        bool get_atom(ByteView& value) const {
+            if(!is(TYPE::Atom)) return false;
+            value = bytes();
+            return true;
+        }
+
+        bool get_binary(ByteView& value) const {
+            if(!is(TYPE::Binary)) return false;
+            value = bytes();
+            return true;
+        }
+
+        // STRING_EXT; the empty string arrives as [], an empty list
+        bool get_string(ByteView& value) const {
+            if(!is(TYPE::String) && !(is(TYPE::List) && node().size == 0)) return false;
+            value = bytes();
+            return true;
+        }
+
+        // the atom's name, empty when this is not an atom
+        ByteView atom() const {
+            ByteView value;
+            get_atom(value);
+            return value;
+        }
+
+        // the term of this node in the buffer
+        TermCursor cursor() const {
+            return valid() ? TermCursor(term_->buf_, node().offset) : TermCursor();
+        }
+
+        // decode this part of the term into `out`, see EIDecoder::decode_into
+        template <typename T>
+        bool decode_into(T& out, const AtomTable* atoms = nullptr) const {
+            static_assert(!detail::is_compound_node<T>::value, "wrapper nodes need an Arena, use parse(Arena&)");
+            if(!valid()) return false;
+
+            EIDecoder decoder(cursor());
+            decoder.set_atom_table(atoms);
+            decoder.decode_into(out);
+            return decoder.is_valid();
+        }
+
+        // decode this part of the term into wrapper nodes carved out of
+        // `arena`, nullptr when it does not have the shape of T
+        template <typename T>
+        typename std::enable_if<std::is_base_of<detail::_Base, T>::value && !T::is_single, T*>::type
+        parse(Arena& arena) const {
+            if(!valid()) return nullptr;
+
+            EIDecoder decoder(cursor(), &arena);
+            T* result = decoder.parse<T>();
+            return decoder.is_valid() ? result : nullptr;
+        }
+
+    private:
+        friend class Term;
+
+        Ref(const Term* term, uint32_t node): term_(term), node_(node) {}
+
+        const Node& node() const {
+            return term_->nodes_[node_];
+        }
+
+        // a string, binary or atom
+        ByteView bytes() const {
+            const Node& n = node();
+            if(n.type == TYPE::List) return ByteView();
+            if(n.type == TYPE::Atom && n.size <= sizeof(n.value.bytes)) return ByteView(n.value.bytes, n.size);
+            return ByteView(n.value.data, n.size);
+        }
+
+        const Term* term_;
+        uint32_t node_;
+    };
+
+    Term(): buf_(nullptr) {}
+
+    // the term of a whole message, after its version byte
+    explicit Term(const char* buf): Term() {
+        decode(buf);
+    }
+
+    explicit Term(const TermCursor& cursor): Term() {
+        decode(cursor);
+    }
+
+    // Decode another message. The node array is kept, so a Term reused for
+    // message after message stops allocating once it has grown to the
+    // working size. Returns valid().
+    bool decode(const char* buf) {
+        if((unsigned char)buf[0] != ERL_VERSION_MAGIC) {
+            nodes_.clear();
+            buf_ = nullptr;
+            return false;
+        }
+        return decode(TermCursor(buf, 1));
+    }
+
+    bool decode(const TermCursor& cursor) {
+        nodes_.clear();
+        buf_ = cursor.buffer();
+        if(!cursor.valid()) {
+            buf_ = nullptr;
+            return false;
+        }
+
+        uint64_t start = detail::stats_clock();
+        int index = cursor.index();
+        nodes_.resize(1);
+        if(decode_node(&index, 0) != 0) {
+            nodes_.clear();
+            buf_ = nullptr;
+            return false;
+        }
+
+        detail::stats_term(false, (size_t)(index - cursor.index()), start);
+        return true;
+    }
+
+    bool valid() const {
+        return !nodes_.empty();
+    }
+
+    Ref root() const {
+        return valid() ? Ref(this, 0) : Ref();
+    }
+
+    // number of nodes, the root included
+    size_t node_count() const {
+        return nodes_.size();
+    }
+
+private:
+    int decode_node(int* index, uint32_t slot) {
+        Node node;
+        node.offset = *index;
+        node.size = 0;
+        node.value.integer = 0;
+        if(!detail::type_of_tag(buf_[*index], &node.type)) return -1;
+
+        int arity = 0;
+        ByteView view;
+        switch(node.type) {
+            case TYPE::Integer:
+                if(ei_decode_long(buf_, index, &node.value.integer) != 0) return -1;
+                break;
+            case TYPE::Float:
+                if(ei_decode_double(buf_, index, &node.value.number) != 0) return -1;
+                break;
+            case TYPE::String:
+                node.size = detail::get_be16(buf_ + *index + 1);
+                node.value.data = buf_ + *index + 3;
+                if(!detail::advance(index, 3 + (size_t)node.size)) return -1;
+                break;
+            case TYPE::Binary:
+                if(detail::BinaryViewDecoder()(buf_, index, view, nullptr) != 0) return -1;
+                node.size = (uint32_t)view.size();
+                node.value.data = view.data();
+                break;
+            case TYPE::Atom:
+                if(detail::AtomViewDecoder()(buf_, index, view, nullptr) != 0) return -1;
+                node.size = (uint32_t)view.size();
+                if(view.size() <= sizeof(node.value.bytes)) {
+                    memcpy(node.value.bytes, view.data(), view.size());
+                } else {
+                    node.value.data = view.data();
+                }
+                break;
+            case TYPE::List:
+                if(ei_decode_list_header(buf_, index, &arity) != 0) return -1;
+                break;
+            case TYPE::Tuple:
+                if(ei_decode_tuple_header(buf_, index, &arity) != 0) return -1;
+                break;
+            case TYPE::Map:
+                if(ei_decode_map_header(buf_, index, &arity) != 0) return -1;
+                break;
+        }
+        detail::stats_nodes(node.type);
+
+        // the children take consecutive slots, their own children come after
+        size_t children = node.type == TYPE::Map ? 2 * (size_t)arity : (size_t)arity;
+        if(children > 0) {
+            node.size = (uint32_t)arity;
+            node.value.first = (uint32_t)nodes_.size();
+            nodes_.resize(nodes_.size() + children);
+            for(size_t i = 0; i < children; i++) {
+                if(decode_node(index, node.value.first + (uint32_t)i) != 0) return -1;
+            }
+
+            // only proper lists
+            if(node.type == TYPE::List && (ei_decode_list_header(buf_, index, &arity) != 0 || arity != 0)) {
+                return -1;
+            }
+        }
+
+        nodes_[slot] = node;
+        return 0;
+    }
+
+    const char* buf_;
+    std::vector<Node> nodes_;
+};
+
+
+#ifdef EIPP_POSIX
+// A term_to_binary file mapped into memory, to be decoded in place: pages are
+// read from disk as the decoder gets to them, so opening a snapshot of
+// gigabytes costs nothing up front and only what is decoded ends up
+// resident. Views decoded from it point into the mapping and are valid as
+// long as the MappedTermFile lives. The file must not be truncated while
+// mapped, and must hold a whole term: like a buffer in memory, it is not
+// bounds checked while decoding. ei indexes terms with an int, so files
+// over 2 GiB are refused with EFBIG.
+//
+//   eipp::MappedTermFile file("snapshot.etf");
+//   eipp::EIDecoder decoder(file.data(), file.size());
+//   auto rows = decoder.parse<eipp::List<Row>>();
+class MappedTermFile {
+public:
+    // how the term will be read, passed on to madvise()
+    enum class Access {
+        Sequential,     // front to back, once: read ahead, drop behind
+        Random,         // here and there, e.g. through a TermCursor
+        Normal
+    };
+
+    explicit MappedTermFile(const std::string& path, Access access = Access::Sequential):
+            data_(nullptr), size_(0), error_(0) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            error_ = errno;
+            return;
+        }
+
+        struct stat st;
+        if(::fstat(fd, &st) != 0) {
+            error_ = errno;
+        } else if(st.st_size < 2) {
+            error_ = EINVAL;        // not even a version byte and a tag
+        } else if((uint64_t)st.st_size > (uint64_t)std::numeric_limits<int>::max()) {
+            error_ = EFBIG;
+        } else {
+            void* p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED) {
+                error_ = errno;
+            } else {
+                data_ = static_cast<const char*>(p);
+                size_ = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+
+        if(data_ && (unsigned char)data_[0] != ERL_VERSION_MAGIC) {
+            unmap();
+            error_ = EINVAL;
+        }
+        if(data_) advise(access);
+    }
+
+    MappedTermFile(const MappedTermFile&) = delete;
+    MappedTermFile& operator=(const MappedTermFile&) = delete;
+
+    MappedTermFile(MappedTermFile&& other): data_(other.data_), size_(other.size_), error_(other.error_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappedTermFile& operator=(MappedTermFile&& other) {
+        if(this != &other) {
+            unmap();
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            error_ = other.error_;
+        }
+        return *this;
+    }
+
+    ~MappedTermFile() {
+        unmap();
+    }
+
+    bool is_valid() const {
+        return data_ != nullptr;
+    }
+
+    // errno of the call that failed, EINVAL for a file that is no term,
+    // EFBIG for one over 2 GiB
+    int error() const {
+        return error_;
+    }
+
+    // the whole file, version byte included, to give to EIDecoder with its
+    // size (which also takes compressed terms)
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool compressed() const {
+        return data_ && data_[1] == detail::compressed_tag;
+    }
+
+    // the term, to be looked at without decoding it all; invalid if the
+    // term is compressed
+    TermCursor cursor() const {
+        return data_ && !compressed() ? TermCursor(data_) : TermCursor();
+    }
+
+    // Change the hint for `length` bytes from `offset`, e.g. Random before
+    // jumping around with a cursor, or Sequential again for a long scan.
+    void advise(Access access, size_t offset = 0, size_t length = std::numeric_limits<size_t>::max()) {
+        if(!data_ || offset >= size_) return;
+
+        int advice = access == Access::Sequential ? MADV_SEQUENTIAL :
+                     access == Access::Random ? MADV_RANDOM : MADV_NORMAL;
+        size_t page = (size_t)::sysconf(_SC_PAGESIZE);
+        size_t begin = offset / page * page;
+        size_t end = length < size_ - offset ? offset + length : size_;
+        ::madvise(const_cast<char*>(data_) + begin, end - begin, advice);
+    }
+
+    // Give back the pages read so far, e.g. after decoding into owning
+    // types. The mapping stays: pages touched again are read back in, so
+    // views remain valid.
+    void release() {
+        if(data_) ::madvise(const_cast<char*>(data_), size_, MADV_DONTNEED);
+    }
+
+private:
+    void unmap() {
+        if(data_) ::munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const char* data_;
+    size_t size_;
+    int error_;
+};
+#endif
+
+
+// Receives the terms found by StreamDecoder, in order. Compound terms are
+// reported as a *_begin call, their children, then on_end(). Views passed
+// to a callback are only valid during that call.
+class StreamHandler {
+public:
+    virtual ~StreamHandler() {}
+
+    virtual void on_integer(long) {}
+    virtual void on_double(double) {}
+    virtual void on_atom(ByteView) {}
+    virtual void on_string(ByteView) {}
+
+    // binaries are handed over piece by piece, as the bytes arrive
+    virtual void on_binary_begin(size_t) {}
+    virtual void on_binary_chunk(ByteView) {}
+    virtual void on_binary_end() {}
+
+    virtual void on_tuple_begin(size_t) {}
+    // the length of the list's first chunk; a list written in chunks (see
+    // StreamEncoder) has more elements before its on_end()
+    virtual void on_list_begin(size_t) {}
+    virtual void on_map_begin(size_t) {}
+    virtual void on_end() {}
+};
+
+
+// Incremental decoder for one term that arrives in pieces. feed() accepts
+// any split of the input, down to single bytes, and remembers where it is
+// in the nested tuples, lists and maps between calls. Only an incomplete
+// scalar is buffered (at most 64 KiB), so memory stays bounded however big
+// the term is.
+class StreamDecoder {
+public:
+    enum class Status {
+        NeedMore,
+        Done,
+        Error
+    };
+
+    explicit StreamDecoder(StreamHandler* handler, bool with_version = true):
+            handler_(handler), with_version_(with_version) {
+        reset();
+    }
+
+    StreamDecoder(const StreamDecoder&) = delete;
+    StreamDecoder&operator=(const StreamDecoder&) = delete;
+
+    // start over with the next term
+    void reset() {
+        status_ = Status::NeedMore;
+        need_version_ = with_version_;
+        binary_left_ = 0;
+        in_binary_ = false;
+        consumed_ = 0;
+        pending_.clear();
+        stack_.clear();
+    }
+
+    // Once the term is complete the rest of `data` is left alone, and
+    // consumed() tells where it starts.
+    Status feed(const char* data, size_t size) {
+        size_t pos = 0;
+
+        while(pos < size && status_ == Status::NeedMore) {
+            if(in_binary_) {
+                size_t n = std::min(binary_left_, size - pos);
+                handler_->on_binary_chunk(ByteView(data + pos, n));
+                pos += n;
+                binary_left_ -= n;
+                if(binary_left_ == 0) {
+                    end_binary();
+                }
+                continue;
+            }
+
+            if(need_version_) {
+                if((unsigned char)data[pos] != ERL_VERSION_MAGIC) {
+                    status_ = Status::Error;
+                    break;
+                }
+                need_version_ = false;
+                pos++;
+                continue;
+            }
+
+            // the whole token is at hand, decode it in place
+            if(pending_.empty()) {
+                size_t need = token_size(data + pos, size - pos);
+                if(need == invalid_token) {
+                    status_ = Status::Error;
+                    break;
+                }
+                if(need != 0 && need <= size - pos) {
+                    token(data + pos);
+                    pos += need;
+                    continue;
+                }
+            }
+
+            // otherwise gather it piece by piece, a byte at a time until its
+            // size is known
+            size_t need = token_size(pending_.data(), pending_.size());
+            if(need == invalid_token) {
+                status_ = Status::Error;
+                break;
+            }
+            size_t want = need == 0 ? 1 : need - pending_.size();
+            size_t n = std::min(want, size - pos);
+            pending_.append(data + pos, n);
+            pos += n;
+
+            if(need != 0 && pending_.size() == need) {
+                token(pending_.data());
+                pending_.clear();
+            }
+        }
+
+        consumed_ = pos;
+        return status_;
+    }
+
+    Status status() const {
+        return status_;
+    }
+
+    // bytes taken from the last feed()
+    size_t consumed() const {
+        return consumed_;
+    }
+
+private:
+    struct Frame {
+        TYPE type;
+        size_t left;    // children still to come, a list's tail included
+    };
+
+    enum: size_t { invalid_token = ~(size_t)0 };
+
+    // Size of the token at `p`, the BINARY_EXT payload excluded; 0 while
+    // `avail` is too short to tell. Integers must fit a long, so a bigger
+    // big is refused before any of it is buffered.
+    static size_t token_size(const char* p, size_t avail) {
+        if(avail == 0) return 0;
+
+        switch(p[0]) {
+            case ERL_NIL_EXT:
+                return 1;
+            case ERL_SMALL_INTEGER_EXT:
+                return 2;
+            case ERL_INTEGER_EXT:
+                return 5;
+            case NEW_FLOAT_EXT:
+                return 9;
+            case ERL_FLOAT_EXT:
+                return 32;
+            case ERL_SMALL_TUPLE_EXT:
+                return 2;
+            case ERL_LARGE_TUPLE_EXT:
+            case ERL_LIST_EXT:
+            case ERL_MAP_EXT:
+            case ERL_BINARY_EXT:
+                return 5;
+            case ERL_SMALL_ATOM_EXT:
+            case ERL_SMALL_ATOM_UTF8_EXT:
+                return avail < 2 ? 0 : 2 + (unsigned char)p[1];
+            case ERL_ATOM_EXT:
+            case ERL_ATOM_UTF8_EXT:
+            case ERL_STRING_EXT:
+                return avail < 3 ? 0 : 3 + detail::get_be16(p + 1);
+            case ERL_SMALL_BIG_EXT:
+                if(avail < 2) return 0;
+                if((unsigned char)p[1] > sizeof(long)) return invalid_token;
+                return 3 + (unsigned char)p[1];
+            case ERL_LARGE_BIG_EXT:
+                if(avail < 5) return 0;
+                if(detail::get_be32(p + 1) > sizeof(long)) return invalid_token;
+                return 6 + detail::get_be32(p + 1);
+            default:
+                return 1;   // not supported, token() reports it
+        }
+    }
+
+    void token(const char* p) {
+        int index = 0;
+
+        // The last child of a list is its tail, which must be [], or a list
+        // that goes on with more elements (as StreamEncoder writes them).
+        // The handler sees one list either way.
+        if(!stack_.empty() && stack_.back().type == TYPE::List && stack_.back().left == 1) {
+            if(p[0] == ERL_LIST_EXT) {
+                stack_.back().left = detail::get_be32(p + 1) + (size_t)1;
+                return;
+            }
+            if(p[0] != ERL_NIL_EXT) {
+                status_ = Status::Error;
+                return;
+            }
+
+            stack_.pop_back();
+            handler_->on_end();
+            complete();
+            return;
+        }
+
+        switch(p[0]) {
+            case ERL_SMALL_INTEGER_EXT:
+            case ERL_INTEGER_EXT:
+            case ERL_SMALL_BIG_EXT:
+            case ERL_LARGE_BIG_EXT: {
+                long value = 0;
+                if(ei_decode_long(p, &index, &value) != 0) break;
+                handler_->on_integer(value);
+                complete();
+                return;
+            }
+            case NEW_FLOAT_EXT:
+            case ERL_FLOAT_EXT: {
+                double value = 0;
+                if(ei_decode_double(p, &index, &value) != 0) break;
+                handler_->on_double(value);
+                complete();
+                return;
+            }
+            case ERL_SMALL_ATOM_EXT:
+            case ERL_SMALL_ATOM_UTF8_EXT:
+                handler_->on_atom(ByteView(p + 2, (unsigned char)p[1]));
+                complete();
+                return;
+            case ERL_ATOM_EXT:
+            case ERL_ATOM_UTF8_EXT:
+                handler_->on_atom(ByteView(p + 3, detail::get_be16(p + 1)));
+                complete();
+                return;
+            case ERL_STRING_EXT:
+                handler_->on_string(ByteView(p + 3, detail::get_be16(p + 1)));
+                complete();
+                return;
+            case ERL_NIL_EXT:
+                handler_->on_list_begin(0);
+                handler_->on_end();
+                complete();
+                return;
+            case ERL_BINARY_EXT:
+                binary_left_ = detail::get_be32(p + 1);
+                handler_->on_binary_begin(binary_left_);
+                in_binary_ = true;
+                if(binary_left_ == 0) {
+                    end_binary();
+                }
+                return;
+            case ERL_LIST_EXT:
+                begin(TYPE::List, detail::get_be32(p + 1), 1);
+                return;
+            case ERL_SMALL_TUPLE_EXT:
+                begin(TYPE::Tuple, (unsigned char)p[1], 1);
+                return;
+            case ERL_LARGE_TUPLE_EXT:
+                begin(TYPE::Tuple, detail::get_be32(p + 1), 1);
+                return;
+            case ERL_MAP_EXT:
+                begin(TYPE::Map, detail::get_be32(p + 1), 2);
+                return;
+            default:
+                break;
+        }
+
+        status_ = Status::Error;
+    }
+
+    void begin(TYPE type, size_t arity, size_t children_per_entry) {
+        if(type == TYPE::List) {
+            handler_->on_list_begin(arity);
+        } else if(type == TYPE::Tuple) {
+            handler_->on_tuple_begin(arity);
+        } else {
+            handler_->on_map_begin(arity);
+        }
+
+        if(arity == 0) {
+            handler_->on_end();
+            complete();
+            return;
+        }
+
+        Frame frame;
+        frame.type = type;
+        frame.left = arity * children_per_entry + (type == TYPE::List ? 1 : 0);
+        stack_.push_back(frame);
+    }
+
+    void end_binary() {
+        in_binary_ = false;
+        handler_->on_binary_end();
+        complete();
+    }
+
+    // a child term is finished; close every compound it completes
+    void complete() {
+        while(!stack_.empty()) {
+            if(--stack_.back().left != 0) return;
+
+            stack_.pop_back();
+            handler_->on_end();
+        }
+
+        status_ = Status::Done;
+    }
+
+    StreamHandler* handler_;
+    bool with_version_;
+    bool need_version_;
+    bool in_binary_;
+    size_t binary_left_;
+    size_t consumed_;
+    Status status_;
+    std::string pending_;
+    std::vector<Frame> stack_;
+};
+
+
+// Numbers encoded as one binary holding the elements back to back in
+// little-endian order, the native layout of x86 and ARM. On the Erlang side
+//     [X || <<X:64/float-little>> <= Bin]      for doubles
+//     [X || <<X:32/signed-little>> <= Bin]     for int32_t
+// and so on with the element's size and signedness. It is much more compact
+// than a list of numbers and costs a single copy, or none when the encoder
+// references large binaries. The data must outlive the encoding.
+template <typename T>
+struct RawArray {
+    static_assert(std::is_arithmetic<T>::value, "RawArray holds numbers");
+
+    const T* data;
+    size_t size;
+
+    RawArray(const T* d, size_t n): data(d), size(n) {}
+};
+
+template <typename T>
+RawArray<T> raw_array(const std::vector<T>& v) {
+    return RawArray<T>(v.data(), v.size());
+}
+
+template <typename T>
+RawArray<T> raw_array(const T* data, size_t size) {
+    return RawArray<T>(data, size);
+}
+
+
+namespace detail {
+    // Upper bounds on what one ei_encode_* call writes. They only pick the
+    // fast path; near the end of the buffer the exact size is asked from ei.
+    const size_t max_scalar_size = 16;
+
+    inline size_t max_atom_size(size_t len) {
+        return 8 + 2 * len;     // Latin-1 may grow to UTF-8
+    }
+
+    inline size_t max_string_size(size_t len) {
+        return 8 + 2 * len;     // long strings become lists of small integers
+    }
+
+    inline size_t max_binary_size(size_t len) {
+        return 8 + len;
+    }
+
+    const size_t max_integer_size = 3 + sizeof(long);     // SMALL_BIG_EXT
+    const size_t max_float_size = 9;
+
+    // The same bytes as ei_encode_long and ei_encode_double, written inline
+    // so a run of numbers does not pay a library call per element.
+    inline int encode_long(char* buf, int* index, long value) {
+        if(value >= 0 && value <= 255) {
+            if(buf) {
+                buf[*index] = ERL_SMALL_INTEGER_EXT;
+                buf[*index + 1] = (char)value;
+            }
+            *index += 2;
+            return 0;
+        }
+
+        if(value >= ERL_MIN && value <= ERL_MAX) {
+            if(buf) {
+                buf[*index] = ERL_INTEGER_EXT;
+                put_be32(buf + *index + 1, (uint32_t)value);
+            }
+            *index += 5;
+            return 0;
+        }
+
+        return ei_encode_long(buf, index, value);
+    }
+
+    inline int encode_double(char* buf, int* index, double value) {
+        if(buf) {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            buf[*index] = NEW_FLOAT_EXT;
+            put_be64(buf + *index + 1, bits);
+        }
+        *index += 9;
+        return 0;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, int>::type
+    encode_number(char* buf, int* index, T value) {
+        return encode_long(buf, index, (long)value);
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value, int>::type
+    encode_number(char* buf, int* index, T value) {
+        return encode_double(buf, index, (double)value);
+    }
+
+    // Erlang encodes a list of integers in 0..255 shorter than 65536 elements
+    // as STRING_EXT, one byte per element, and so does EIEncoder.
+    template <typename T>
+    typename std::enable_if<std::is_integral<typename T::value_type>::value, bool>::type
+    is_byte_list(const T& arg) {
+        if(arg.empty() || arg.size() > 0xffff) return false;
+
+        for(auto element: arg) {
+            long value = (long)element;
+            if(value < 0 || value > 255) return false;
+        }
+        return true;
+    }
+
+    template <typename T>
+    typename std::enable_if<!std::is_integral<typename T::value_type>::value, bool>::type
+    is_byte_list(const T&) {
+        return false;
+    }
+
+    // Size of the term as EIEncoder::encode writes it, version byte excluded.
+    // Scalars are measured by ei itself (a NULL buffer only advances the
+    // index), so the result is exact by construction.
+    struct TermSize {
+        // list, vector, deque
+        template <typename T>
+        static typename std::enable_if<is_sequence_container<T>::value, size_t>::type
+        of(const T& arg) {
+            if(arg.empty()) return 1;
+            if(is_byte_list(arg)) return 3 + arg.size();
+
+            constexpr size_t fixed = fixed_term_size<typename T::value_type>::value;
+            if(fixed != 0) return 5 + arg.size() * fixed + 1;
+
+            size_t size = 5 + 1;
+            for(auto& element: arg) {
+                size += of(element);
+            }
+            return size;
+        }
+
+        // tuple
+        template <typename T>
+        static typename std::enable_if<std::tuple_size<T>::value >= 0, size_t>::type
+        of(const T& arg) {
+            int header = 0;
+            ei_encode_tuple_header(nullptr, &header, (int)std::tuple_size<T>::value);
+            return (size_t)header + TupleHelper<std::tuple_size<T>::value, T>::of(arg);
+        }
+
+        // map
+        template <typename T>
+        static typename std::enable_if<
+                std::is_same<typename T::value_type, std::pair<const typename T::key_type, typename T::mapped_type>>::value,
+                size_t>::type
+        of(const T& arg) {
+            size_t size = 5;
+            for(auto& iter: arg) {
+                size += of(iter.first) + of(iter.second);
+            }
+            return size;
+        }
+
+        // integral
+        template <typename T>
+        static typename std::enable_if<std::is_integral<T>::value, size_t>::type
+        of(const T& arg) {
+            int size = 0;
+            ei_encode_long(nullptr, &size, (long)arg);
+            return (size_t)size;
+        }
+
+        // double
+        template <typename T>
+        static typename std::enable_if<std::is_floating_point<T>::value, size_t>::type
+        of(const T& arg) {
+            int size = 0;
+            ei_encode_double(nullptr, &size, (double)arg);
+            return (size_t)size;
+        }
+
+        // atom
+        template <typename T>
+        static typename std::enable_if<std::is_base_of<_Base, T>::value && T::category_type == TYPE::Atom, size_t>::type
+        of(const T& arg) {
+            int size = 0;
+            ei_encode_atom_len(nullptr, &size, arg.get_value().data(), (int)arg.get_value().size());
+            return (size_t)size;
+        }
+
+        // binary
+        template <typename T>
+        static typename std::enable_if<std::is_base_of<_Base, T>::value && T::category_type == TYPE::Binary, size_t>::type
+        of(const T& arg) {
+            int size = 0;
+            ei_encode_binary(nullptr, &size, arg.get_value().data(), (long)arg.get_value().size());
+            return (size_t)size;
+        }
+
+        // string
+        template <typename T>
+        static typename std::enable_if<is_one_of<T, char *, unsigned char *>::value, size_t>::type
+        of(const T& arg) {
+            int size = 0;
+            ei_encode_string(nullptr, &size, (const char*)arg);
+            return (size_t)size;
+        }
+
+        template <typename T>
+        static typename std::enable_if<std::is_base_of<_Base, T>::value && T::category_type == TYPE::String, size_t>::type
+        of(const T& arg) {
+            int size = 0;
+            ei_encode_string_len(nullptr, &size, arg.get_value().data(), (int)arg.get_value().size());
+            return (size_t)size;
+        }
+
+        static size_t of(const std::string& arg) {
+            int size = 0;
+            ei_encode_string_len(nullptr, &size, arg.data(), (int)arg.size());
+            return (size_t)size;
+        }
+
+        template <typename T>
+        static size_t of(const RawArray<T>& arg) {
+            return 5 + arg.size * sizeof(T);
+        }
+
+        // struct described with EIPP_RECORD or EIPP_MAP_STRUCT
+        template <typename T>
+        static typename std::enable_if<described<T>::value, size_t>::type
+        of(const T& arg) {
+            typedef typename described<T>::type info;
+            bool record = info::kind() == StructKind::Record;
+
+            int size = record ? 0 : 5;
+            if(record) {
+                ei_encode_tuple_header(nullptr, &size, (int)info::size + 1);
+                ei_encode_atom_len(nullptr, &size, info::name(), (int)info::name_size());
+            }
+
+            FieldSize visitor = {!record, (size_t)size};
+            info::each(arg, visitor);
+            return visitor.size;
+        }
+
+        static size_t of(const EncodedAtom& arg) {
+            return arg.bytes.size();
+        }
+
+        struct FieldSize {
+            bool keys;
+            size_t size;
+
+            template <typename V>
+            bool operator()(const char* name, size_t len, const V& field) {
+                if(keys) {
+                    int key = 0;
+                    ei_encode_atom_len(nullptr, &key, name, (int)len);
+                    size += (size_t)key;
+                }
+                size += TermSize::of(field);
+                return true;
+            }
+        };
+
+        template <int N, typename T>
+        struct TupleHelper {
+            static size_t of(const T& tuple) {
+                constexpr auto index = std::tuple_size<T>::value - N;
+                return TermSize::of(std::get<index>(tuple)) + TupleHelper<N-1, T>::of(tuple);
+            }
+        };
+
+        template <typename T>
+        struct TupleHelper<0, T> {
+            static size_t of(const T&) {
+                return 0;
+            }
+        };
+    };
+}
+
+// Exact number of bytes EIEncoder produces for `arg`, version byte included,
+// i.e. the size of get_data() after encode(arg) on a fresh encoder.
+template <typename T>
+size_t encoded_size(const T& arg) {
+    return 1 + detail::TermSize::of(arg);
+}
+
+// The same as a compile time constant for types whose encoding never varies
+// (floating point, bool, unsigned char, and tuples/std::array of those);
+// 0 for every other type.
+template <typename T>
+struct fixed_encoded_size: std::integral_constant<size_t,
+        detail::fixed_term_size<T>::value == 0 ? 0 : 1 + detail::fixed_term_size<T>::value> {};
+
+
+namespace detail {
+    // A fixed set of threads that run parallel_for() jobs together with the
+    // calling thread. Each worker starts on its own slice of the indexes and,
+    // once done, steals half of what is left of another worker's slice, so
+    // workers rarely touch the same lock and slow items even out.
+    class ThreadPool {
+    public:
+        // `threads` extra threads; the caller always works too
+        explicit ThreadPool(size_t threads): ranges_(new Range[threads + 1]), job_(nullptr),
+                busy_(0), generation_(0), stop_(false) {
+            for(size_t i = 0; i < threads; i++) {
+                threads_.emplace_back(&ThreadPool::work, this, i + 1);
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool&operator = (const ThreadPool&) = delete;
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+
+            for(auto& thread: threads_) {
+                thread.join();
+            }
+        }
+
+        // number of workers, the caller included; worker ids run from 0
+        size_t size() const {
+            return threads_.size() + 1;
+        }
+
+        // call func(index, worker) for every index in [0, n), return when
+        // done; one job at a time
+        void parallel_for(size_t n, const std::function<void(size_t, size_t)>& func) {
+            if(threads_.empty() || n < 2) {
+                for(size_t i = 0; i < n; i++) func(i, 0);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                size_t workers = size();
+                for(size_t w = 0; w < workers; w++) {
+                    std::lock_guard<std::mutex> range_lock(ranges_[w].mutex);
+                    ranges_[w].begin = n * w / workers;
+                    ranges_[w].end = n * (w + 1) / workers;
+                }
+
+                job_ = &func;
+                busy_ = threads_.size();
+                generation_++;
+            }
+            wake_.notify_all();
+
+            run_items(0);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this]() { return busy_ == 0; });
+            job_ = nullptr;
+        }
+
+    private:
+        struct Range {
+            std::mutex mutex;
+            size_t begin = 0;
+            size_t end = 0;
+        };
+
+        void work(size_t id) {
+            uint64_t seen = 0;
+            while(true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [this, seen]() { return stop_ || generation_ != seen; });
+                    if(stop_) return;
+                    seen = generation_;
+                }
+
+                run_items(id);
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                if(--busy_ == 0) done_.notify_one();
+            }
+        }
+
+        void run_items(size_t id) {
+            size_t i = 0;
+            while(true) {
+                if(pop(id, &i)) {
+                    (*job_)(i, id);
+                } else if(!steal(id)) {
+                    break;
+                }
+            }
+        }
+
+        bool pop(size_t id, size_t* index) {
+            Range& range = ranges_[id];
+            std::lock_guard<std::mutex> lock(range.mutex);
+            if(range.begin == range.end) return false;
+
+            *index = range.begin++;
+            return true;
+        }
+
+        // move the back half of some other worker's slice into ours
+        bool steal(size_t id) {
+            size_t workers = size();
+            for(size_t k = 1; k < workers; k++) {
+                Range& victim = ranges_[(id + k) % workers];
+                size_t begin = 0, end = 0;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if(victim.begin == victim.end) continue;
+
+                    begin = victim.begin + (victim.end - victim.begin) / 2;
+                    end = victim.end;
+                    victim.end = begin;
+                }
+
+                Range& own = ranges_[id];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                own.begin = begin;
+                own.end = end;
+                return true;
+            }
+            return false;
+        }
+
+        std::vector<std::thread> threads_;
+        std::unique_ptr<Range[]> ranges_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+
+        const std::function<void(size_t, size_t)>* job_;
+        size_t busy_;
+        uint64_t generation_;
+        bool stop_;
+    };
+}
+
+
+class EIEncoder {
+public:
+    // Terms are encoded with ei_encode_* straight into one buffer that grows
+    // geometrically. Compound headers are written in place before their
+    // children, since the arity is always known up front.
+    EIEncoder(): ret_(0), buf_(nullptr), capacity_(0), index_(1), owns_buf_(true),
+            reference_threshold_(0), referenced_size_(0),
+            compression_threshold_(0), compression_level_(0), compressed_(false),
+            parallel_threshold_(0) {
+    }
+
+    // Encode into caller owned memory. The buffer never grows: encoding more
+    // than `size` bytes leaves the encoder invalid. size() tells how much of
+    // `buf` was used.
+    EIEncoder(char* buf, size_t size): ret_(0), buf_(buf), capacity_(size), index_(1), owns_buf_(false),
+            reference_threshold_(0), referenced_size_(0),
+            compression_threshold_(0), compression_level_(0), compressed_(false),
+            parallel_threshold_(0) {
+        if(size == 0) {
+            ret_ = -1;
+            return;
+        }
+
+        buf_[0] = (char)ERL_VERSION_MAGIC;
+    }
+
+    EIEncoder(const EIEncoder&) = delete;
+    EIEncoder&operator = (const EIEncoder&) = delete;
+
+    // the buffer and the options move along; `rhs` is left a fresh encoder
+    EIEncoder(EIEncoder&& rhs): EIEncoder() {
+        take(rhs);
+    }
+
+    EIEncoder&operator = (EIEncoder&& rhs) {
+        if(this != &rhs) {
+            if(owns_buf_) free(buf_);
+            take(rhs);
+        }
+        return *this;
+    }
+
+    ~EIEncoder() {
+        if(owns_buf_) {
+            free(buf_);
+        }
+    }
+
+    // Start over for the next term, keeping the buffer and the options, so
+    // an encoder used again and again stops allocating once its buffer has
+    // grown to the working size.
+    void reset() {
+        ret_ = 0;
+        index_ = 1;
+        referenced_size_ = 0;
+        refs_.clear();
+        compressed_ = false;
+#ifdef EIPP_ENABLE_STATS
+        stats_start_ = 0;
+#endif
+    }
+
+    // bytes the buffer holds without growing
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // From now on binaries of at least `bytes` are not copied: only their
+    // header is encoded and the payload is referenced from get_iovecs(). The
+    // payload must stay alive until the output has been written. 0 turns
+    // this off.
+    void set_reference_threshold(size_t bytes) {
+        reference_threshold_ = bytes;
+    }
+
+    // Encode lists and maps of at least `min_elements` elements on `threads`
+    // threads, the caller included: the elements are split into chunks that
+    // are encoded side by side and then appended in order. Elements are only
+    // read, and containers nested inside them are encoded on one thread.
+    // 1 turns this off.
+    void set_threads(size_t threads, size_t min_elements = 4096) {
+        pool_.reset(threads > 1 ? new detail::ThreadPool(threads - 1) : nullptr);
+        parallel_threshold_ = std::max(min_elements, (size_t)2);
+    }
+
+#ifdef EIPP_WITH_ZLIB
+    // Output of at least `threshold` bytes is compressed by finish(), like
+    // term_to_binary(T, [{compressed, level}]) does; it is kept as is when
+    // compression does not make it smaller. 0 turns this off.
+    void set_compression(size_t threshold, int level = Z_DEFAULT_COMPRESSION) {
+        compression_threshold_ = threshold;
+        compression_level_ = level;
+    }
+#endif
+
+    // Done encoding: apply what works on the whole output, i.e. compression.
+    // get_data() calls it; call it before data(), size() or get_iovecs()
+    // when compression is on. Nothing can be encoded afterwards.
+    void finish() {
+#ifdef EIPP_WITH_ZLIB
+        if(ret_ == 0 && !compressed_ && compression_threshold_ != 0 && size() >= compression_threshold_) {
+            compress();
+        }
+#endif
+#ifdef EIPP_ENABLE_STATS
+        if(ret_ == 0 && stats_start_ != 0) detail::stats_term(true, size(), stats_start_);
+        stats_start_ = 0;
+#endif
+    }
+
+    // make sure the buffer holds at least `bytes` in total without growing
+    void reserve(size_t bytes) {
+        if(bytes > capacity_ && !grow_to(bytes)) {
+            ret_ = -1;
+        }
+    }
+
+    // encode `arg` with its exact size allocated up front, so the output is
+    // allocated once and never moved
+    template <typename T>
+    void encode_exact(const T& arg) {
+        reserve(index_ + encoded_size(arg) - 1);
+        encode(arg);
+    }
+
+    // list, vector, deque
+    template <typename T>
+    typename std::enable_if<detail::is_sequence_container<T>::value>::type
+    encode(const T& arg) {
+        if(ret_ != 0) return;
+
+        int arity = (int)arg.size();
+        if(arity == 0) {
+            put(detail::max_scalar_size, [](char* buf, int* index) {
+                return ei_encode_empty_list(buf, index);
+            });
+            return;
+        }
+
+        encode_elements(arg);
+    }
+
+    // tuple
+    template <typename T>
+    typename std::enable_if<std::tuple_size<T>::value >= 0 >::type
+    encode(const T& arg) {
+        if(ret_ != 0) return;
+
+        constexpr size_t arity = std::tuple_size<T>::value;
+        put(detail::max_scalar_size, [](char* buf, int* index) {
+            return ei_encode_tuple_header(buf, index, (int)arity);
+        });
+        TupleEncoderHelper<arity, T>::encode(this, arg);
+    }
+
+    // map
+    template <typename T>
+    typename std::enable_if<
+            std::is_same<typename T::value_type, std::pair<const typename T::key_type, typename T::mapped_type>>::value>::type
+    encode(const T& arg) {
+        if(ret_ != 0) return;
+
+        int arity = (int)arg.size();
+        put(detail::max_scalar_size, [arity](char* buf, int* index) {
+            return ei_encode_map_header(buf, index, arity);
+        });
+
+        if(parallel(arg.size())) {
+            encode_chunks(arg.begin(), arg.size(), [](EIEncoder& part, typename T::const_iterator iter) {
+                part.encode(iter->first);
+                part.encode(iter->second);
+            });
+            return;
+        }
+
+        for(auto& iter: arg) {
+            encode(iter.first);
+            encode(iter.second);
+        }
+    };
+
+    // integral
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value>::type
+    encode(const T& arg) {
+        long value = (long)arg;
+        put(detail::max_integer_size, [value](char* buf, int* index) {
+            return detail::encode_long(buf, index, value);
+        });
+    }
+
+    // double
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type
+    encode(const T& arg) {
+        double value = (double)arg;
+        put(detail::max_float_size, [value](char* buf, int* index) {
+            return detail::encode_double(buf, index, value);
+        });
+    }
+
+    // interned atom, copied from its encoded form
+    void
+    encode(const EncodedAtom& arg) {
+        if(arg.bytes.empty()) {
+            ret_ = -1;
+            return;
+        }
+
+        const char* data = arg.bytes.data();
+        size_t size = arg.bytes.size();
+        put(size, [data, size](char* buf, int* index) {
+            if(buf) memcpy(buf + *index, data, size);
+            *index += (int)size;
+            return 0;
+        });
+    }
+
+    // numbers as one little-endian binary, see RawArray
+    template <typename T>
+    void encode(const RawArray<T>& arg) {
+        size_t size = arg.size * sizeof(T);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if(reference_threshold_ != 0 && size >= reference_threshold_) {
+            encode_binary_reference(reinterpret_cast<const char*>(arg.data), size);
+            return;
+        }
+#endif
+
+        const T* data = arg.data;
+        size_t n = arg.size;
+        put(detail::max_binary_size(size), [data, n, size](char* buf, int* index) {
+            if(buf) {
+                char* p = buf + *index;
+                *p++ = ERL_BINARY_EXT;
+                detail::put_be32(p, (uint32_t)size);
+                p += 4;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                memcpy(p, data, size);
+#else
+                for(size_t i = 0; i < n; i++, p += sizeof(T)) {
+                    const char* e = reinterpret_cast<const char*>(data + i);
+                    std::reverse_copy(e, e + sizeof(T), p);
+                }
+#endif
+            }
+            (void)n;
+            *index += 5 + (int)size;
+            return 0;
+        });
+    }
+
+    // atom
+    template <typename T>
+    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::category_type == TYPE::Atom>::type
+    encode(const T& arg) {
+        encode_atom(arg.value.data(), arg.value.size());
+    };
+
+    // struct described with EIPP_RECORD or EIPP_MAP_STRUCT
+    template <typename T>
+    typename std::enable_if<detail::described<T>::value>::type
+    encode(const T& arg) {
+        typedef typename detail::described<T>::type info;
+        bool record = info::kind() == detail::StructKind::Record;
+
+        int arity = (int)info::size;
+        put(detail::max_scalar_size, [record, arity](char* buf, int* index) {
+            return record ? ei_encode_tuple_header(buf, index, arity + 1) : ei_encode_map_header(buf, index, arity);
+        });
+        if(record) {
+            encode_atom(info::name(), info::name_size());
+        }
+
+        FieldEncoder visitor = {this, !record};
+        info::each(arg, visitor);
+    }
+
+    // binary
+    template <typename T>
+    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::category_type == TYPE::Binary>::type
+    encode(const T& arg) {
+        const char* data = arg.value.data();
+        long len = (long)arg.value.size();
+        if(reference_threshold_ != 0 && (size_t)len >= reference_threshold_) {
+            encode_binary_reference(data, (size_t)len);
+            return;
+        }
+
+        put(detail::max_binary_size((size_t)len), [data, len](char* buf, int* index) {
+            return ei_encode_binary(buf, index, data, len);
+        });
+    };
+
+    // string
+    template <typename T>
+    typename std::enable_if<detail::is_one_of<T, char *, unsigned char *>::value>::type
+    encode(const T& arg) {
+        encode_string((const char*)arg, std::strlen((const char*)arg));
+    };
+
+    template <typename T>
+    typename std::enable_if<std::is_base_of<detail::_Base, T>::value && T::category_type == TYPE::String>::type
+    encode(const T& arg) {
+        encode_string(arg.value.data(), arg.value.size());
+    };
+
+    void
+    encode(const std::string& arg) {
+        encode_string(arg.data(), arg.size());
+    }
+
+    bool is_valid() const {
+        return ret_ == 0;
+    }
+
+    // bytes encoded so far, version byte and referenced binaries included
+    size_t size() const {
+        return index_ + referenced_size_;
+    }
+
+    // The encoded buffer, without copying. It holds the whole term unless
+    // binaries were referenced, see get_iovecs().
+    const char* data() const {
+        static const char version_only = (char)ERL_VERSION_MAGIC;
+        return buf_ ? buf_ : &version_only;
+    }
+
+    std::string get_data() {
+        finish();
+        if(ret_!=0) {
+            return std::string();
+        }
+
+        return assemble();
+    }
+
+#ifdef EIPP_POSIX
+    // The output as pieces ready for writev(): slices of the encoded buffer
+    // interleaved with the referenced binary payloads.
+    std::vector<struct iovec> get_iovecs() const {
+        std::vector<struct iovec> vec;
+        if(ret_ != 0) return vec;
+
+        size_t pos = 0;
+        for(auto& ref: refs_) {
+            push_iovec(vec, data() + pos, ref.offset - pos);
+            push_iovec(vec, ref.data, ref.size);
+            pos = ref.offset;
+        }
+        push_iovec(vec, data() + pos, index_ - pos);
+        return vec;
+    }
+#endif
+
+private:
+    template<int N, typename T>
+    struct TupleEncoderHelper;
+
+    template<int N, typename T>
+    struct TupleEncoderHelper {
+        static void encode(EIEncoder* encoder, const T& tuple) {
+            constexpr auto index = std::tuple_size<T>::value - N;
+            auto& element = std::get<index>(tuple);
+            encoder->encode(element);
+            TupleEncoderHelper<N-1, T>::encode(encoder, tuple);
+        }
+    };
+
+    template <typename T>
+    struct TupleEncoderHelper<0, T> {
+        static void encode(EIEncoder*, const T&) {
+        }
+    };
+
+    struct Reference {
+        size_t offset;      // where the payload belongs in the buffer
+        const char* data;
+        size_t size;
+    };
+
+    // the output in one piece, referenced binaries copied in
+    std::string assemble() const {
+        std::string s;
+        s.reserve(size());
+
+        size_t pos = 0;
+        for(auto& ref: refs_) {
+            s.append(data() + pos, ref.offset - pos);
+            s.append(ref.data, ref.size);
+            pos = ref.offset;
+        }
+        s.append(data() + pos, index_ - pos);
+        return s;
+    }
+
+    void encode_binary_reference(const char* data, size_t size) {
+        uint32_t len = (uint32_t)size;
+        put(detail::max_scalar_size, [len](char* buf, int* index) {
+            if(buf) {
+                buf[*index] = ERL_BINARY_EXT;
+                detail::put_be32(buf + *index + 1, len);
+            }
+            *index += 5;
+            return 0;
+        });
+        if(ret_ != 0) return;
+
+        Reference ref;
+        ref.offset = index_;
+        ref.data = data;
+        ref.size = size;
+        refs_.push_back(ref);
+        referenced_size_ += size;
+    }
+
+#ifdef EIPP_POSIX
+    static void push_iovec(std::vector<struct iovec>& vec, const char* data, size_t size) {
+        if(size == 0) return;
+
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(data);
+        iov.iov_len = size;
+        vec.push_back(iov);
+    }
+#endif
+
+    // Numbers are written in one go with a single bound check for the run,
+    // integers in 0..255 as a byte string like Erlang does.
+    template <typename T>
+    typename std::enable_if<std::is_integral<typename T::value_type>::value>::type
+    encode_elements(const T& arg) {
+        if(!detail::is_byte_list(arg)) {
+            encode_numbers(arg, detail::max_integer_size);
+            return;
+        }
+
+        size_t n = arg.size();
+        put(3 + n, [&arg, n](char* buf, int* index) {
+            if(buf) {
+                char* p = buf + *index;
+                *p++ = ERL_STRING_EXT;
+                *p++ = (char)(n >> 8);
+                *p++ = (char)n;
+                for(auto element: arg) {
+                    *p++ = (char)(long)element;
+                }
+            }
+            *index += 3 + (int)n;
+            return 0;
+        });
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<typename T::value_type>::value>::type
+    encode_elements(const T& arg) {
+        encode_numbers(arg, detail::max_float_size);
+    }
+
+    template <typename T>
+    void encode_numbers(const T& arg, size_t element_size) {
+        int arity = (int)arg.size();
+        put(5 + arg.size() * element_size + 1, [&arg, arity](char* buf, int* index) {
+            ei_encode_list_header(buf, index, arity);
+            for(auto element: arg) {
+                detail::encode_number(buf, index, element);
+            }
+            return ei_encode_empty_list(buf, index);
+        });
+    }
+
+    template <typename T>
+    typename std::enable_if<!std::is_arithmetic<typename T::value_type>::value>::type
+    encode_elements(const T& arg) {
+        int arity = (int)arg.size();
+        put(detail::max_scalar_size, [arity](char* buf, int* index) {
+            return ei_encode_list_header(buf, index, arity);
+        });
+
+        if(parallel(arg.size())) {
+            encode_chunks(arg.begin(), arg.size(), [](EIEncoder& part, typename T::const_iterator iter) {
+                part.encode(*iter);
+            });
+        } else {
+            for(auto& element: arg) {
+                encode(element);
+            }
+        }
+
+        put(detail::max_scalar_size, [](char* buf, int* index) {
+            return ei_encode_empty_list(buf, index);
+        });
+    }
+
+    bool parallel(size_t elements) const {
+        return pool_ && elements >= parallel_threshold_;
+    }
+
+    // Encode the `n` elements from `first` with `func(encoder, iterator)` in
+    // chunks on the pool, each chunk into an encoder of its own, then append
+    // the chunks in order.
+    template <typename Iter, typename F>
+    void encode_chunks(Iter first, size_t n, F func) {
+        if(ret_ != 0) return;
+
+        size_t chunks = std::min(n, pool_->size() * 4);
+        std::vector<Iter> starts;
+        starts.reserve(chunks);
+        for(size_t c = 0; c < chunks; c++) {
+            starts.push_back(first);
+            std::advance(first, n * (c + 1) / chunks - n * c / chunks);
+        }
+
+        std::vector<EIEncoder> parts(chunks);
+        size_t threshold = reference_threshold_;
+        pool_->parallel_for(chunks, [&](size_t c, size_t) {
+            EIEncoder& part = parts[c];
+            part.reference_threshold_ = threshold;
+
+            Iter iter = starts[c];
+            for(size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++, ++iter) {
+                func(part, iter);
+            }
+        });
+
+        size_t total = 0;
+        for(auto& part: parts) {
+            if(!part.is_valid()) {
+                ret_ = -1;
+                return;
+            }
+            total += part.index_ - 1;
+        }
+
+        reserve(index_ + total);
+        for(auto& part: parts) {
+            append(part);
+        }
+    }
+
+    // the term of `part`, without its version byte, at the end of ours
+    void append(const EIEncoder& part) {
+        size_t base = index_ - 1;
+        const char* data = part.data() + 1;
+        size_t size = part.index_ - 1;
+        put(size, [data, size](char* buf, int* index) {
+            if(buf) memcpy(buf + *index, data, size);
+            *index += (int)size;
+            return 0;
+        });
+        if(ret_ != 0) return;
+
+        for(auto ref: part.refs_) {
+            ref.offset += base;
+            refs_.push_back(ref);
+        }
+        referenced_size_ += part.referenced_size_;
+    }
+
+    struct FieldEncoder {
+        EIEncoder* encoder;
+        bool keys;
+
+        template <typename V>
+        bool operator()(const char* name, size_t len, const V& field) {
+            if(keys) encoder->encode_atom(name, len);
+            encoder->encode(field);
+            return encoder->ret_ == 0;
+        }
+    };
+
+    void encode_atom(const char* data, size_t size) {
+        int len = (int)size;
+        put(detail::max_atom_size(size), [data, len](char* buf, int* index) {
+            return ei_encode_atom_len(buf, index, data, len);
+        });
+    }
+
+    void encode_string(const char* data, size_t size) {
+        int len = (int)size;
+        put(detail::max_string_size(size), [data, len](char* buf, int* index) {
+            return ei_encode_string_len(buf, index, data, len);
+        });
+    }
+
+    // Run one ei_encode_* call, `func(buf, index)`, at the end of the buffer.
+    // When `max_size` may not fit, ei is first asked for the exact size with
+    // a NULL buffer and the buffer grows to fit it.
+    template <typename F>
+    void put(size_t max_size, F func) {
+        if(ret_ != 0) return;
+        if(compressed_) {
+            ret_ = -1;
+            return;
+        }
+#ifdef EIPP_ENABLE_STATS
+        if(stats_start_ == 0) stats_start_ = detail::stats_clock();
+#endif
+
+        if(index_ + max_size > capacity_) {
+            int end = (int)index_;
+            if(func(nullptr, &end) != 0 || !grow_to((size_t)end)) {
+                ret_ = -1;
+                return;
+            }
+        }
+
+        int index = (int)index_;
+        ret_ = func(buf_, &index);
+        index_ = (size_t)index;
+    }
+
+#ifdef EIPP_WITH_ZLIB
+    void compress() {
+        std::string term = assemble();
+        uLong len = (uLong)term.size() - 1;
+        uLongf zlen = compressBound(len);
+
+        char* out = static_cast<char*>(malloc(detail::compressed_header_size + zlen));
+        if(out == nullptr) {
+            ret_ = -1;
+            return;
+        }
+        detail::stats_add(detail::stat_buffer_allocations, 1);
+
+        if(compress2(reinterpret_cast<Bytef*>(out + detail::compressed_header_size), &zlen,
+                reinterpret_cast<const Bytef*>(term.data() + 1), len, compression_level_) != Z_OK) {
+            free(out);
+            ret_ = -1;
+            return;
+        }
+
+        // Not worth it, or it does not fit caller memory, which holds only
+        // the copied part of the term and not the referenced binaries. The
+        // output stays uncompressed then.
+        size_t size = detail::compressed_header_size + zlen;
+        if(size >= term.size() || (!owns_buf_ && size > capacity_)) {
+            free(out);
+            return;
+        }
+
+        out[0] = (char)ERL_VERSION_MAGIC;
+        out[1] = detail::compressed_tag;
+        detail::put_be32(out + 2, (uint32_t)len);
+
+        if(owns_buf_) {
+            free(buf_);
+            buf_ = out;
+            capacity_ = size;
+        } else {
+            memcpy(buf_, out, size);
+            free(out);
+        }
+
+        index_ = size;
+        refs_.clear();
+        referenced_size_ = 0;
+        compressed_ = true;
+    }
+#endif
+
+    void take(EIEncoder& rhs) {
+        ret_ = rhs.ret_;
+        buf_ = rhs.buf_;
+        capacity_ = rhs.capacity_;
+        index_ = rhs.index_;
+        owns_buf_ = rhs.owns_buf_;
+        reference_threshold_ = rhs.reference_threshold_;
+        referenced_size_ = rhs.referenced_size_;
+        refs_ = std::move(rhs.refs_);
+        compression_threshold_ = rhs.compression_threshold_;
+        compression_level_ = rhs.compression_level_;
+        compressed_ = rhs.compressed_;
+        pool_ = std::move(rhs.pool_);
+        parallel_threshold_ = rhs.parallel_threshold_;
+#ifdef EIPP_ENABLE_STATS
+        stats_start_ = rhs.stats_start_;
+        rhs.stats_start_ = 0;
+#endif
+
+        rhs.ret_ = 0;
+        rhs.buf_ = nullptr;
+        rhs.capacity_ = 0;
+        rhs.index_ = 1;
+        rhs.owns_buf_ = true;
+        rhs.referenced_size_ = 0;
+        rhs.refs_.clear();
+        rhs.compressed_ = false;
+    }
+
+    bool grow_to(size_t bytes) {
+        if(bytes <= capacity_) return true;
+        if(!owns_buf_) return false;
+
+        size_t capacity = std::max(bytes, capacity_ * 2);
+        if(buf_ == nullptr) {
+            capacity = std::max(bytes, (size_t)64);
+        }
+
+        char* buf = static_cast<char*>(realloc(buf_, capacity));
+        if(buf == nullptr) return false;
+        detail::stats_add(detail::stat_buffer_allocations, 1);
+
+        if(buf_ == nullptr) {
+            buf[0] = (char)ERL_VERSION_MAGIC;
+        }
+
+        buf_ = buf;
+        capacity_ = capacity;
+        return true;
+    }
+
+    int ret_;
+    char* buf_;
+    size_t capacity_;
+    size_t index_;
+    bool owns_buf_;
+
+    size_t reference_threshold_;
+    size_t referenced_size_;
+    std::vector<Reference> refs_;
+
+    size_t compression_threshold_;
+    int compression_level_;
+    bool compressed_;
+
+    std::unique_ptr<detail::ThreadPool> pool_;
+    size_t parallel_threshold_;
+
+#ifdef EIPP_ENABLE_STATS
+    uint64_t stats_start_ = 0;  // when encoding of the current term began
+#endif
+};
+
+
+// Keeps reset encoders around for reuse, so encoding steady traffic does
+// not allocate once the buffers have grown. Safe to share between threads.
+class EncoderPool {
+public:
+    // An encoder on loan; it goes back to the pool when the handle dies.
+    class Handle {
+    public:
+        Handle(): pool_(nullptr) {}
+        Handle(EncoderPool* pool, std::unique_ptr<EIEncoder> encoder): pool_(pool), encoder_(std::move(encoder)) {}
+
+        Handle(Handle&& rhs): pool_(rhs.pool_), encoder_(std::move(rhs.encoder_)) {}
+
+        Handle&operator = (Handle&& rhs) {
+            if(this != &rhs) {
+                release();
+                pool_ = rhs.pool_;
+                encoder_ = std::move(rhs.encoder_);
+            }
+            return *this;
+        }
+
+        ~Handle() {
+            release();
+        }
+
+        EIEncoder& operator *() const {
+            return *encoder_;
+        }
+
+        EIEncoder* operator ->() const {
+            return encoder_.get();
+        }
+
+    private:
+        void release() {
+            if(pool_ && encoder_) pool_->put_back(std::move(encoder_));
+        }
+
+        EncoderPool* pool_;
+        std::unique_ptr<EIEncoder> encoder_;
+    };
+
+    // Keep at most `max_idle` encoders, and none whose buffer grew beyond
+    // `max_capacity` bytes, so one huge message does not pin its memory.
+    explicit EncoderPool(size_t max_idle = 64, size_t max_capacity = 1 << 20):
+            max_idle_(max_idle), max_capacity_(max_capacity) {}
+
+    EncoderPool(const EncoderPool&) = delete;
+    EncoderPool&operator = (const EncoderPool&) = delete;
+
+    Handle acquire() {
+        std::unique_ptr<EIEncoder> encoder;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(!idle_.empty()) {
+                encoder = std::move(idle_.back());
+                idle_.pop_back();
+            }
+        }
+
+        if(!encoder) encoder.reset(new EIEncoder());
+        return Handle(this, std::move(encoder));
+    }
+
+    size_t idle() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return idle_.size();
+    }
+
+private:
+    void put_back(std::unique_ptr<EIEncoder> encoder) {
+        if(encoder->capacity() > max_capacity_) return;
+
+        encoder->reset();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(idle_.size() < max_idle_) {
+            idle_.push_back(std::move(encoder));
+        }
+    }
+
+    size_t max_idle_;
+    size_t max_capacity_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<EIEncoder>> idle_;
+};
+
+// This thread's encoder, reset and ready. Meant for encoding one reply at a
+// time: a second call on the same thread resets it again.
+inline EIEncoder& local_encoder() {
+    static thread_local EIEncoder encoder;
+    encoder.reset();
+    return encoder;
+}
+
+
+// Encodes one term while it is being produced, handing finished bytes to a
+// sink as it goes, so a list of unknown length (rows from a database
+// cursor, say) never has to be held in memory. Lists are written as chunks
+// of at most `chunk_elements` elements, each chunk being the tail of the one
+// before, which Erlang reads as one list; EIDecoder::decode, List,
+// TermCursor and StreamDecoder do too, while Term rejects such a list. Once `flush_bytes`
+// are held back by open chunks, the chunks end early, nested lists
+// included, so memory stays at about `flush_bytes` plus the element being
+// encoded. The term has no length prefix, so it suits a socket, a file or a
+// {packet, 0} port rather than {packet, N}.
+//
+//   eipp::StreamEncoder out(eipp::StreamEncoder::fd_sink(fd));
+//   out.tuple_header(2);
+//   out.encode(eipp::Atom("rows"));
+//   out.begin_list();
+//   while(cursor.next(row)) out.encode(row);
+//   out.end_list();
+//   out.finish();
+class StreamEncoder {
+public:
+    // takes `size` bytes of the output, false to give up
+    typedef std::function<bool(const char* data, size_t size)> Sink;
+
+    explicit StreamEncoder(Sink sink, size_t chunk_elements = 1024, size_t flush_bytes = 64 << 10):
+            sink_(std::move(sink)), chunk_elements_(std::max(chunk_elements, (size_t)1)),
+            flush_bytes_(flush_bytes), ret_(0), written_(0), start_(0) {
+        out_.push_back((char)ERL_VERSION_MAGIC);
+    }
+
+#ifdef EIPP_POSIX
+    // write everything to `fd`
+    static Sink fd_sink(int fd) {
+        return [fd](const char* data, size_t size) {
+            while(size > 0) {
+                ssize_t n = ::write(fd, data, size);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) return false;
+
+                data += n;
+                size -= (size_t)n;
+            }
+            return true;
+        };
+    }
+#endif
+
+    // a whole term: an element of the innermost open list, tuple or map,
+    // or the term itself
+    template <typename T>
+    void encode(const T& value) {
+        if(ret_ != 0) return;
+
+        scratch_.reset();
+        scratch_.encode(value);
+        if(!scratch_.is_valid()) {
+            ret_ = -1;
+            return;
+        }
+
+        append(scratch_.data() + 1, scratch_.size() - 1);
+        term_done();
+    }
+
+    // the next `arity` terms are the elements of a tuple
+    void tuple_header(size_t arity) {
+        header(arity, arity, [](char* buf, int* index, int n) {
+            return ei_encode_tuple_header(buf, index, n);
+        });
+    }
+
+    // the next `arity` pairs of terms are the keys and values of a map
+    void map_header(size_t arity) {
+        header(arity, 2 * arity, [](char* buf, int* index, int n) {
+            return ei_encode_map_header(buf, index, n);
+        });
+    }
+
+    // the terms up to end_list() are the elements of a list
+    void begin_list() {
+        if(ret_ != 0) return;
+
+        Frame frame;
+        frame.list = true;
+        frame.sealed = false;
+        frames_.push_back(frame);
+        open_chunk(frames_.back());
+    }
+
+    void end_list() {
+        if(ret_ != 0) return;
+        if(frames_.empty() || !frames_.back().list) {
+            ret_ = -1;
+            return;
+        }
+
+        Frame& frame = frames_.back();
+        if(frame.count > 0) {
+            close_chunk(frame);
+        } else {
+            out_.resize(frame.header);      // no elements after all
+        }
+        out_.push_back((char)ERL_NIL_EXT);
+
+        frames_.pop_back();
+        term_done();
+    }
+
+    // a list of the elements in [first, last)
+    template <typename Iter>
+    void encode_list(Iter first, Iter last) {
+        begin_list();
+        for(; first != last && ret_ == 0; ++first) {
+            encode(*first);
+        }
+        end_list();
+    }
+
+    // a list of the values `next(value)` produces until it returns false
+    template <typename T, typename F>
+    void generate_list(F next) {
+        T value;
+        begin_list();
+        while(ret_ == 0 && next(value)) {
+            encode(value);
+        }
+        end_list();
+    }
+
+    // Hand what is left to the sink. The term must be complete: every list,
+    // tuple and map closed.
+    bool finish() {
+        if(ret_ == 0 && !frames_.empty()) ret_ = -1;
+        if(ret_ == 0) flush(out_.size());
+        if(ret_ == 0) detail::stats_term(true, (size_t)written_, start_);
+        return ret_ == 0;
+    }
+
+    bool is_valid() const {
+        return ret_ == 0;
+    }
+
+    // bytes handed to the sink so far
+    uint64_t written() const {
+        return written_;
+    }
+
+private:
+    // an open list (the elements in its current chunk) or tuple or map (the
+    // terms still to come)
+    struct Frame {
+        bool list;
+        bool sealed;        // list: the chunk ends with the element in progress
+        size_t header;      // list: where the current chunk's header goes
+        size_t count;
+    };
+
+    template <typename F>
+    void header(size_t arity, size_t terms, F func) {
+        if(ret_ != 0) return;
+
+        char buf[detail::max_scalar_size];
+        int index = 0;
+        if(arity > (size_t)std::numeric_limits<int32_t>::max() || func(buf, &index, (int)arity) != 0) {
+            ret_ = -1;
+            return;
+        }
+        append(buf, (size_t)index);
+
+        if(terms == 0) {
+            term_done();
+            return;
+        }
+
+        Frame frame;
+        frame.list = false;
+        frame.sealed = false;
+        frame.header = 0;
+        frame.count = terms;
+        frames_.push_back(frame);
+    }
+
+    // a term is complete: count it in the container it belongs to
+    void term_done() {
+        while(!frames_.empty()) {
+            Frame& frame = frames_.back();
+            if(frame.list) {
+                if(frame.sealed) {
+                    open_chunk(frame);
+                } else if(++frame.count == chunk_elements_) {
+                    close_chunk(frame);
+                    open_chunk(frame);
+                }
+                break;
+            }
+
+            if(--frame.count > 0) break;
+            frames_.pop_back();     // the tuple or map is a complete term now
+        }
+
+        if(out_.size() < flush_bytes_) return;
+
+        size_t ready = unwritten();
+        if(ready < flush_bytes_) {
+            seal_chunks();
+            ready = unwritten();
+        }
+        flush(ready);
+    }
+
+    // where the first chunk header that is not written yet goes; it holds
+    // back what follows
+    size_t unwritten() const {
+        for(auto& frame: frames_) {
+            if(frame.list && !frame.sealed) return frame.header;
+        }
+        return out_.size();
+    }
+
+    // End every open chunk now: the innermost list's after its last
+    // element, the others after the element being encoded in them.
+    void seal_chunks() {
+        for(size_t i = 0; i < frames_.size(); i++) {
+            Frame& frame = frames_[i];
+            if(!frame.list || frame.sealed) continue;
+
+            if(i + 1 < frames_.size()) {
+                frame.count++;
+                close_chunk(frame);
+                frame.sealed = true;
+            } else if(frame.count > 0) {
+                close_chunk(frame);
+                open_chunk(frame);
+            }
+        }
+    }
+
+    void open_chunk(Frame& frame) {
+        frame.header = out_.size();
+        frame.count = 0;
+        frame.sealed = false;
+        out_.resize(out_.size() + 5);
+    }
+
+    void close_chunk(Frame& frame) {
+        out_[frame.header] = (char)ERL_LIST_EXT;
+        detail::put_be32(&out_[frame.header + 1], (uint32_t)frame.count);
+    }
+
+    void append(const char* data, size_t size) {
+        if(start_ == 0) start_ = detail::stats_clock();
+        out_.insert(out_.end(), data, data + size);
+    }
+
+    void flush(size_t size) {
+        if(size == 0) return;
+        if(!sink_(out_.data(), size)) {
+            ret_ = -1;
+            return;
+        }
+
+        written_ += size;
+        out_.erase(out_.begin(), out_.begin() + (std::ptrdiff_t)size);
+        for(auto& frame: frames_) {
+            if(frame.list && !frame.sealed) frame.header -= size;
+        }
+    }
+
+    Sink sink_;
+    size_t chunk_elements_;
+    size_t flush_bytes_;
+
+    int ret_;
+    uint64_t written_;
+    uint64_t start_;
+    std::vector<char> out_;
+    std::vector<Frame> frames_;
+    EIEncoder scratch_;
+};
+
+
+// Decodes batches of independent messages on a thread pool. Every worker
+// has its own Arena, so workers never share an allocator for the nodes, and
+// results come back in input order whatever thread decoded them. A batch
+// frees what the previous one allocated in the Arenas: consume or copy the
+// results of parse() (and views in the results of decode()) first.
+class BatchDecoder {
+public:
+    // `threads` extra threads besides the caller
+    explicit BatchDecoder(size_t threads = default_threads()): pool_(threads) {
+        for(size_t i = 0; i < pool_.size(); i++) {
+            arenas_.emplace_back(new Arena());
+        }
+    }
+
+    BatchDecoder(const BatchDecoder&) = delete;
+    BatchDecoder&operator = (const BatchDecoder&) = delete;
+
+    // out[i] = EIDecoder::decode<T>() of inputs[i]; returns how many inputs
+    // failed, their entries are left default constructed
+    template <typename T>
+    size_t decode(const std::vector<ByteView>& inputs, std::vector<T>& out) {
+        static_assert(!std::is_same<T, bool>::value, "std::vector<bool> cannot be written from several threads");
+
+        out.clear();
+        out.resize(inputs.size());
+        return run(inputs.size(), [&inputs, &out, this](size_t i, size_t worker) {
+            EIDecoder decoder(inputs[i].data(), inputs[i].size(), arenas_[worker].get());
+            out[i] = decoder.decode<T>();
+            return decoder.is_valid();
+        });
+    }
+
+    // out[i] = EIDecoder::parse<T>() of inputs[i], nullptr where it failed
+    template <typename T>
+    typename std::enable_if<!T::is_single, size_t>::type
+    parse(const std::vector<ByteView>& inputs, std::vector<T*>& out) {
+        out.assign(inputs.size(), nullptr);
+        return run(inputs.size(), [&inputs, &out, this](size_t i, size_t worker) {
+            EIDecoder decoder(inputs[i].data(), inputs[i].size(), arenas_[worker].get());
+            T* result = decoder.parse<T>();
+            if(decoder.is_valid()) out[i] = result;
+            return decoder.is_valid();
+        });
+    }
+
+    size_t threads() const {
+        return pool_.size();
+    }
+
+private:
+    static size_t default_threads() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n > 1 ? n - 1 : 0;
+    }
+
+    template <typename F>
+    size_t run(size_t n, F decode_one) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(auto& arena: arenas_) {
+            arena->reset();
+        }
+
+        std::atomic<size_t> failed(0);
+        pool_.parallel_for(n, [&decode_one, &failed](size_t i, size_t worker) {
+            if(!decode_one(i, worker)) failed++;
+        });
+        return failed;
+    }
+
+    std::mutex mutex_;
+    detail::ThreadPool pool_;
+    std::vector<std::unique_ptr<Arena>> arenas_;
+};
+
+// the process wide BatchDecoder decode_batch() uses, one thread pool
+// whatever the types decoded
+inline BatchDecoder& default_batch_decoder() {
+    static BatchDecoder batch;
+    return batch;
+}
+
+// decode a batch on the process wide BatchDecoder, see BatchDecoder::decode
+template <typename T>
+size_t decode_batch(const std::vector<ByteView>& inputs, std::vector<T>& out) {
+    return default_batch_decoder().decode(inputs, out);
+}
+
+
+#ifdef EIPP_POSIX
+// The main loop of an Erlang port program: reads requests framed as
+// {packet, N} from a file descriptor (stdin by default), hands each one to
+// the handler registered for its tag and writes the replies back, framed
+// the same way (stdout by default).
+//
+// A request is routed by its atom, or by the atom in the first element of a
+// tuple, e.g. {add, 1, 2} goes to on("add", ...). A handler encodes its
+// reply into the given EIEncoder; encoding nothing sends no reply. So that
+// the caller is not left waiting, a request too short to be a term is
+// answered {error, bad_request}, and a reply the handler failed to encode
+// (one that overflowed caller memory, say) goes out as
+// {error, encode_failed}.
+//
+// Input is read in large chunks and every complete request in a chunk is
+// handled as one batch. With workers, the requests of a batch are handled in
+// parallel, and replies always go out in request order, all of them with
+// one writev call.
+class PortServer {
+public:
+    typedef std::function<void(const TermCursor& request, EIEncoder& reply)> Handler;
+
+    // `packet_size` is the N of {packet, N}: 1, 2 or 4
+    explicit PortServer(int packet_size = 4, int in_fd = 0, int out_fd = 1):
+            packet_size_(packet_size == 1 || packet_size == 2 ? (size_t)packet_size : 4),
+            in_fd_(in_fd), out_fd_(out_fd), in_(64 * 1024), begin_(0), end_(0) {
+    }
+
+    PortServer(const PortServer&) = delete;
+    PortServer&operator = (const PortServer&) = delete;
+
+    void on(const char* tag, Handler handler) {
+        AtomId id = tags_.intern(ByteView(tag));
+        if(!id.valid()) return;
+
+        if(handlers_.size() <= id.value) handlers_.resize(id.value + 1);
+        handlers_[id.value] = std::move(handler);
+    }
+
+    // for requests no other handler takes
+    void on_other(Handler handler) {
+        other_ = std::move(handler);
+    }
+
+    // handle requests on `n` extra threads; 0 handles them on the caller's
+    void set_workers(size_t n) {
+        pool_.reset(n ? new detail::ThreadPool(n) : nullptr);
+    }
+
+    // Serve until the input is closed. Returns 0 at a clean end of input and
+    // -1 on a read or write error, a truncated request or a reply too large
+    // for the packet size.
+    int run() {
+        while(true) {
+            if(end_ == in_.size()) make_room();
+
+            ssize_t n = ::read(in_fd_, &in_[end_], in_.size() - end_);
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0) return -1;
+            if(n == 0) return begin_ == end_ ? 0 : -1;
+
+            end_ += (size_t)n;
+            if(serve_batch() != 0) return -1;
+        }
+    }
+
+private:
+    struct Request {
+        const char* data;
+        size_t size;
+    };
+
+    // Drop what was served and make sure the next request fits.
+    void make_room() {
+        size_t pending = end_ - begin_;
+        if(begin_ > 0) {
+            memmove(&in_[0], &in_[begin_], pending);
+            begin_ = 0;
+            end_ = pending;
+        }
+
+        size_t need = pending >= packet_size_ ? packet_size_ + frame_size(&in_[0]) : 0;
+        if(end_ == in_.size() || need > in_.size()) {
+            in_.resize(std::max(in_.size() * 2, need));
+        }
+    }
+
+    size_t frame_size(const char* p) const {
+        switch(packet_size_) {
+            case 1:
+                return (unsigned char)p[0];
+            case 2:
+                return detail::get_be16(p);
+            default:
+                return detail::get_be32(p);
+        }
+    }
+
+    int serve_batch() {
+        requests_.clear();
+        while(end_ - begin_ >= packet_size_) {
+            size_t size = frame_size(&in_[begin_]);
+            if(end_ - begin_ < packet_size_ + size) break;
+
+            Request request;
+            request.data = &in_[begin_ + packet_size_];
+            request.size = size;
+            requests_.push_back(request);
+            begin_ += packet_size_ + size;
+        }
+
+        // reply encoders are kept from batch to batch
+        if(replies_.size() < requests_.size()) {
+            replies_.resize(requests_.size());
+        }
+
+        auto handle = [this](size_t i, size_t) {
+            replies_[i].reset();
+            dispatch(requests_[i], replies_[i]);
+        };
+
+        if(pool_) {
+            pool_->parallel_for(requests_.size(), handle);
+        } else {
+            for(size_t i = 0; i < requests_.size(); i++) handle(i, 0);
+        }
+
+        int ret = write_replies();
+        if(begin_ == end_) {
+            begin_ = end_ = 0;
+        }
+        return ret;
+    }
+
+    void dispatch(const Request& request, EIEncoder& reply) {
+        // not even a version byte and a tag for TermCursor to look at
+        if(request.size < 2 || (unsigned char)request.data[0] != ERL_VERSION_MAGIC) {
+            error_reply(reply, "bad_request");
+            return;
+        }
+
+        TermCursor term(request.data);
+        TermCursor tag = term.type() == TYPE::Tuple ? term.child(0) : term;
+        AtomId id = tag.atom_id(tags_);
+
+        if(id.valid() && id.value < handlers_.size() && handlers_[id.value]) {
+            handlers_[id.value](term, reply);
+        } else if(other_) {
+            other_(term, reply);
+        }
+    }
+
+    int write_replies() {
+        iovecs_.clear();
+        headers_.resize(requests_.size() * 4);
+
+        for(size_t i = 0; i < requests_.size(); i++) {
+            EIEncoder& reply = replies_[i];
+            reply.finish();
+            if(!reply.is_valid()) {
+                reply = EIEncoder();    // the handler may have swapped in caller memory
+                error_reply(reply, "encode_failed");
+            }
+            if(reply.size() <= 1) continue;     // nothing encoded
+
+            size_t size = reply.size();
+            char* header = &headers_[i * 4];
+            if(packet_size_ < 4 && size >> (8 * packet_size_) != 0) return -1;
+
+            detail::put_be32(header, (uint32_t)size);
+            struct iovec iov;
+            iov.iov_base = header + 4 - packet_size_;
+            iov.iov_len = packet_size_;
+            iovecs_.push_back(iov);
+
+            for(auto& piece: reply.get_iovecs()) {
+                iovecs_.push_back(piece);
+            }
+        }
+
+        return write_all(iovecs_.data(), iovecs_.size());
+    }
+
+    static void error_reply(EIEncoder& reply, const char* reason) {
+        reply.encode(std::make_tuple(Atom("error"), Atom(reason)));
+    }
+
+    int write_all(struct iovec* iov, size_t count) {
+        while(count > 0) {
+            int n = (int)std::min<size_t>(count, max_iovecs);
+            ssize_t written = ::writev(out_fd_, iov, n);
+            if(written < 0 && errno == EINTR) continue;
+            if(written < 0) return -1;
+
+            // skip what went out, possibly stopping inside a piece
+            size_t left = (size_t)written;
+            while(count > 0 && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if(count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+        return 0;
+    }
+
+#ifdef IOV_MAX
+    enum: size_t { max_iovecs = IOV_MAX };
+#else
+    enum: size_t { max_iovecs = 1024 };
+#endif
+
+    size_t packet_size_;
+    int in_fd_;
+    int out_fd_;
+
+    AtomTable tags_;
+    std::vector<Handler> handlers_;
+    Handler other_;
+    std::unique_ptr<detail::ThreadPool> pool_;
+
+    std::vector<char> in_;
+    size_t begin_;
+    size_t end_;
+
+    std::vector<Request> requests_;
+    std::vector<EIEncoder> replies_;
+    std::vector<char> headers_;
+    std::vector<struct iovec> iovecs_;
+};
+#endif
+
+
+}
+
+
+// Describe a struct to EIEncoder and EIDecoder, so it is encoded and decoded
+// in place, with no tuple in between. Use at namespace scope, in the
+// namespace of the struct, listing up to 32 fields:
+//
+//   struct Person { long id; std::string name; std::vector<eipp::Atom> tags; };
+//   EIPP_RECORD(Person, id, name, tags)        // {'Person', Id, Name, Tags}
+//   EIPP_NAMED_RECORD(Person, person, id, name, tags)  // #person{} in Erlang
+//   EIPP_MAP_STRUCT(Person, id, name, tags)    // #{id => Id, name => ...}
+//
+// A record must arrive with the right tag and arity. A map may carry its
+// keys in any order and keys that are not fields, which are skipped; fields
+// without a key keep their value.
+#define EIPP_RECORD(Type, ...) \
+    EIPP_DESCRIBE_(Type, ::eipp::detail::StructKind::Record, Type, __VA_ARGS__)
+#define EIPP_NAMED_RECORD(Type, tag, ...) \
+    EIPP_DESCRIBE_(Type, ::eipp::detail::StructKind::Record, tag, __VA_ARGS__)
+#define EIPP_MAP_STRUCT(Type, ...) \
+    EIPP_DESCRIBE_(Type, ::eipp::detail::StructKind::Map, Type, __VA_ARGS__)
+
+#define EIPP_DESCRIBE_(Type, struct_kind, tag, ...) \
+    struct eipp_struct_##Type { \
+        static ::eipp::detail::StructKind kind() { return struct_kind; } \
+        static const char* name() { return #tag; } \
+        static size_t name_size() { return sizeof(#tag) - 1; } \
+        enum: size_t { size = EIPP_PP_COUNT(__VA_ARGS__) }; \
+        template <typename S, typename V> \
+        static void each(S& object, V& visitor) { \
+            EIPP_PP_FOR_EACH(EIPP_FIELD_, __VA_ARGS__) \
+        } \
+    }; \
+    inline eipp_struct_##Type eipp_describe(const Type*) { return eipp_struct_##Type(); }
+
+#define EIPP_FIELD_(field) if(!visitor(#field, sizeof(#field) - 1, object.field)) return;
+
+#define EIPP_PP_EXPAND(x) x
+#define EIPP_PP_CAT(a, b) EIPP_PP_CAT_(a, b)
+#define EIPP_PP_CAT_(a, b) a##b
+#define EIPP_PP_COUNT(...) EIPP_PP_EXPAND(EIPP_PP_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define EIPP_PP_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define EIPP_PP_FOR_EACH(M, ...) EIPP_PP_EXPAND(EIPP_PP_CAT(EIPP_PP_FE_, EIPP_PP_COUNT(__VA_ARGS__))(M, __VA_ARGS__))
+#define EIPP_PP_FE_1(M, x) M(x)
+#define EIPP_PP_FE_2(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_1(M, __VA_ARGS__))
+#define EIPP_PP_FE_3(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_2(M, __VA_ARGS__))
+#define EIPP_PP_FE_4(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_3(M, __VA_ARGS__))
+#define EIPP_PP_FE_5(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_4(M, __VA_ARGS__))
+#define EIPP_PP_FE_6(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_5(M, __VA_ARGS__))
+#define EIPP_PP_FE_7(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_6(M, __VA_ARGS__))
+#define EIPP_PP_FE_8(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_7(M, __VA_ARGS__))
+#define EIPP_PP_FE_9(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_8(M, __VA_ARGS__))
+#define EIPP_PP_FE_10(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_9(M, __VA_ARGS__))
+#define EIPP_PP_FE_11(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_10(M, __VA_ARGS__))
+#define EIPP_PP_FE_12(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_11(M, __VA_ARGS__))
+#define EIPP_PP_FE_13(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_12(M, __VA_ARGS__))
+#define EIPP_PP_FE_14(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_13(M, __VA_ARGS__))
+#define EIPP_PP_FE_15(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_14(M, __VA_ARGS__))
+#define EIPP_PP_FE_16(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_15(M, __VA_ARGS__))
+#define EIPP_PP_FE_17(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_16(M, __VA_ARGS__))
+#define EIPP_PP_FE_18(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_17(M, __VA_ARGS__))
+#define EIPP_PP_FE_19(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_18(M, __VA_ARGS__))
+#define EIPP_PP_FE_20(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_19(M, __VA_ARGS__))
+#define EIPP_PP_FE_21(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_20(M, __VA_ARGS__))
+#define EIPP_PP_FE_22(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_21(M, __VA_ARGS__))
+#define EIPP_PP_FE_23(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_22(M, __VA_ARGS__))
+#define EIPP_PP_FE_24(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_23(M, __VA_ARGS__))
+#define EIPP_PP_FE_25(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_24(M, __VA_ARGS__))
+#define EIPP_PP_FE_26(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_25(M, __VA_ARGS__))
+#define EIPP_PP_FE_27(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_26(M, __VA_ARGS__))
+#define EIPP_PP_FE_28(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_27(M, __VA_ARGS__))
+#define EIPP_PP_FE_29(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_28(M, __VA_ARGS__))
+#define EIPP_PP_FE_30(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_29(M, __VA_ARGS__))
+#define EIPP_PP_FE_31(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_30(M, __VA_ARGS__))
+#define EIPP_PP_FE_32(M, x, ...) M(x) EIPP_PP_EXPAND(EIPP_PP_FE_31(M, __VA_ARGS__))
 
 
 #endif //EIPP_H
@@ -4,8 +4,11 @@
 #include <list>
 #include <tuple>
 #include <map>
+#include <array>
 #include <typeinfo>
 #include <cstring>
+#include <algorithm>
+#include <thread>
 #include "eipp.h"
 
 class ContentLoader {
@@ -155,36 +158,1698 @@ int test_case4() {
     return 0;
 }
 
+int test_case5() {
+    std::cout << std::endl << "test case 5" << std::endl;
 
+    ContentLoader cl3("./test_data/case3");
+    ContentLoader cl4("./test_data/case4");
 
-typedef int(*test_func_t)();
+    using T3 = eipp::List<eipp::Tuple<eipp::Atom, eipp::Long>>;
+    using T4 = eipp::Map<eipp::Long, eipp::Tuple<eipp::Long, eipp::Long, eipp::String>>;
+
+    // one arena shared by many messages, reset between batches
+    eipp::Arena arena;
+    size_t capacity = 0;
+
+    for(int round = 0; round < 3; round++) {
+        eipp::EIDecoder d3(cl3.get_buf(), &arena);
+        auto r3 = d3.parse<T3>();
+        eipp::EIDecoder d4(cl4.get_buf(), &arena);
+        auto r4 = d4.parse<T4>();
+        if(!d3.is_valid() || !d4.is_valid()) {
+            return -1;
+        }
+
+        long sum = 0;
+        for(auto tuple: *r3) {
+            sum += tuple->get<1>();
+        }
+
+        for(auto& iter: *r4) {
+            sum += iter.second->get<1>();
+        }
+
+        if(sum != 131 + 600) {
+            return -2;
+        }
+
+        arena.reset();
+        if(round > 0 && arena.capacity() != capacity) {
+            return -2;
+        }
+        capacity = arena.capacity();
+    }
+
+    std::cout << "arena capacity " << capacity << std::endl;
+    return 0;
+}
+
+int test_case6() {
+    std::cout << std::endl << "test case 6" << std::endl;
+
+    ContentLoader cl2("./test_data/case2");
+    ContentLoader cl3("./test_data/case3");
+
+    using T = eipp::Tuple<eipp::StringView, eipp::BinaryView, eipp::Long, eipp::Double>;
+
+    eipp::EIDecoder decoder(cl2.get_buf());
+    auto result = decoder.parse<T>();
+    if(!decoder.is_valid()) {
+        return -1;
+    }
+
+    eipp::ByteView v1 = result->get<0>();
+    eipp::ByteView v2 = result->get<1>();
+    std::cout << v1 << ", " << v2 << std::endl;
+
+    // the views point into the input buffer
+    const char* begin = cl2.get_buf();
+    if(v1 != "v1string" || v1.data() < begin || v1.data() > begin + 64) {
+        return -2;
+    }
+
+    if(v2 != "v2binary" || v2.data() < begin || v2.data() > begin + 64) {
+        return -2;
+    }
+
+    using T1 = eipp::List<eipp::Tuple<eipp::AtomView, eipp::Long>>;
+
+    eipp::EIDecoder decoder3(cl3.get_buf());
+    auto result3 = decoder3.parse<T1>();
+    if(!decoder3.is_valid()) {
+        return -1;
+    }
+
+    std::string names;
+    for(auto tuple: *result3) {
+        names += tuple->get<0>().to_string() + " ";
+    }
+
+    std::cout << names << std::endl;
+    if(names != "jack jim zoe john steve ") {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case7() {
+    std::cout << std::endl << "test case 7" << std::endl;
+
+    ContentLoader cl2("./test_data/case2");
+    ContentLoader cl3("./test_data/case3");
+    ContentLoader cl4("./test_data/case4");
+
+    eipp::EIDecoder d2(cl2.get_buf());
+    auto r2 = d2.decode<std::tuple<std::string, eipp::BinaryView, int, float>>();
+    if(!d2.is_valid()) {
+        return -1;
+    }
+
+    if(std::get<0>(r2) != "v1string" || std::get<1>(r2).get_value() != "v2binary" || std::get<2>(r2) != 222) {
+        return -2;
+    }
+
+    // a byte string is also a list of integers
+    eipp::EIDecoder d2b(cl2.get_buf());
+    std::tuple<std::vector<char>, eipp::Binary, long, double> r2b;
+    d2b.decode_into(r2b);
+    if(!d2b.is_valid() || std::string(std::get<0>(r2b).begin(), std::get<0>(r2b).end()) != "v1string") {
+        return -2;
+    }
+
+    eipp::EIDecoder d3(cl3.get_buf());
+    auto r3 = d3.decode<std::vector<std::tuple<eipp::Atom, long>>>();
+    if(!d3.is_valid()) {
+        return -1;
+    }
+
+    if(r3.size() != 5 || std::get<0>(r3[4]).get_value() != "steve" || std::get<1>(r3[4]) != 11) {
+        return -2;
+    }
+
+    eipp::EIDecoder d4(cl4.get_buf());
+    auto r4 = d4.decode<std::map<long, std::tuple<long, long, std::string>>>();
+    if(!d4.is_valid()) {
+        return -1;
+    }
+
+    if(r4.size() != 3 || std::get<2>(r4[3]) != "Three" || std::get<1>(r4[3]) != 300) {
+        return -2;
+    }
+
+    // a wrong shape is rejected
+    eipp::EIDecoder d4b(cl4.get_buf());
+    d4b.decode<std::map<long, std::tuple<long, long>>>();
+    if(d4b.is_valid()) {
+        return -2;
+    }
+
+    // round trip through EIEncoder
+    typedef std::tuple<int, std::string, std::list<eipp::Atom>> Person_t;
+    typedef std::tuple<std::vector<Person_t>, std::map<eipp::Binary, std::deque<double>>> Data_t;
+
+    Data_t data;
+    std::get<0>(data).push_back(std::make_tuple(1, "Jim", std::list<eipp::Atom>{eipp::Atom("j1"), eipp::Atom("j2")}));
+    std::get<0>(data).push_back(std::make_tuple(-70000, "", std::list<eipp::Atom>{}));
+    std::get<1>(data).insert(std::make_pair(eipp::Binary("b1"), std::deque<double>{1.5, -2.25}));
+
+    eipp::EIEncoder en;
+    en.encode(data);
+    auto bytes = en.get_data();
+
+    eipp::EIDecoder d5(&bytes[0]);
+    auto decoded = d5.decode<Data_t>();
+    if(!d5.is_valid()) {
+        return -1;
+    }
+
+    eipp::EIEncoder en2;
+    en2.encode(decoded);
+    if(en2.get_data() != bytes) {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case8() {
+    std::cout << std::endl << "test case 8" << std::endl;
+
+    static_assert(eipp::fixed_encoded_size<std::tuple<double, float>>::value == 1 + 2 + 9 + 9, "fixed tuple");
+    static_assert(eipp::fixed_encoded_size<std::array<double, 3>>::value == 1 + 2 + 27, "fixed array");
+    static_assert(eipp::fixed_encoded_size<std::tuple<double, long>>::value == 0, "not fixed");
+
+    typedef std::tuple<int, std::string, std::list<eipp::Atom>> Person_t;
+    std::tuple<std::string, long, std::vector<Person_t>, std::map<eipp::Binary, std::vector<double>>, std::vector<long>> data;
+
+    std::get<0>(data) = std::string(70000, 'x');
+    std::get<1>(data) = 1L << 40;
+    for(int i = 0; i < 300; i++) {
+        std::get<2>(data).push_back(std::make_tuple(i * 1000, "name", std::list<eipp::Atom>{eipp::Atom("a"), eipp::Atom("bb")}));
+    }
+    std::get<3>(data)[eipp::Binary("k")] = std::vector<double>(100, 0.5);
+    std::get<4>(data) = std::vector<long>{-1, 0, 255, 256, -(1L << 27) - 1, 1L << 62};
+
+    eipp::EIEncoder en;
+    en.encode(data);
+
+    eipp::EIEncoder exact;
+    exact.encode_exact(data);
+
+    auto size = eipp::encoded_size(data);
+    std::cout << "encoded size " << size << std::endl;
+    if(!en.is_valid() || !exact.is_valid() || en.get_data().size() != size || exact.get_data() != en.get_data()) {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case9() {
+    std::cout << std::endl << "test case 9" << std::endl;
+
+    std::string blob(1 << 20, 'z');
+    auto data = std::make_tuple(eipp::Atom("ok"), eipp::BinaryView(eipp::ByteView(blob)), 7);
+    auto size = eipp::encoded_size(data);
+
+    eipp::EIEncoder en;
+    en.encode(data);
+    auto expected = en.get_data();
+
+    // caller owned memory, exactly large enough
+    std::vector<char> mem(size);
+    eipp::EIEncoder fixed(&mem[0], mem.size());
+    fixed.encode(data);
+    if(!fixed.is_valid() || fixed.size() != size || std::string(mem.begin(), mem.end()) != expected) {
+        return -2;
+    }
+
+    // one byte short
+    eipp::EIEncoder small(&mem[0], mem.size() - 1);
+    small.encode(data);
+    if(small.is_valid()) {
+        return -2;
+    }
+
+    // scatter-gather: the blob is referenced, not copied
+    eipp::EIEncoder sg;
+    sg.set_reference_threshold(4096);
+    sg.encode(data);
+
+    auto iovecs = sg.get_iovecs();
+    std::string gathered;
+    bool referenced = false;
+    for(auto& iov: iovecs) {
+        gathered.append((const char*)iov.iov_base, iov.iov_len);
+        referenced = referenced || iov.iov_base == blob.data();
+    }
+
+    std::cout << iovecs.size() << " iovecs, " << sg.size() << " bytes" << std::endl;
+    if(!referenced || gathered != expected || sg.get_data() != expected || sg.size() != size) {
+        return -2;
+    }
+
+    return 0;
+}
+
+// writes every event of a StreamDecoder as text
+class LogHandler: public eipp::StreamHandler {
+public:
+    std::string log;
+    std::string binary;
+
+    void on_integer(long v) override { log += "i" + std::to_string(v) + " "; }
+    void on_double(double v) override { log += "d" + std::to_string(v) + " "; }
+    void on_atom(eipp::ByteView v) override { log += "a" + v.to_string() + " "; }
+    void on_string(eipp::ByteView v) override { log += "s" + v.to_string() + " "; }
+    void on_binary_begin(size_t n) override { log += "b" + std::to_string(n) + "( "; binary.clear(); }
+    void on_binary_chunk(eipp::ByteView v) override { binary += v.to_string(); }
+    void on_binary_end() override { log += ") "; }
+    void on_tuple_begin(size_t n) override { log += "{" + std::to_string(n) + " "; }
+    void on_list_begin(size_t n) override { log += "[" + std::to_string(n) + " "; }
+    void on_map_begin(size_t n) override { log += "#" + std::to_string(n) + " "; }
+    void on_end() override { log += "; "; }
+};
+
+int test_case10() {
+    std::cout << std::endl << "test case 10" << std::endl;
+
+    std::string blob(100000, 'q');
+    std::map<eipp::Atom, std::vector<long>> m;
+    m[eipp::Atom("empty")];
+    m[eipp::Atom("nums")] = {1, -5, 1L << 40};
+
+    auto data = std::make_tuple(eipp::Atom("ok"), std::make_tuple(), std::string("text"),
+            eipp::BinaryView(eipp::ByteView(blob)), 2.5, m, std::list<std::list<int>>{{}, {7}});
+
+    eipp::EIEncoder en;
+    en.encode(data);
+    auto bytes = en.get_data() + "trailing";
+
+    LogHandler whole;
+    eipp::StreamDecoder sd(&whole);
+    if(sd.feed(bytes.data(), bytes.size()) != eipp::StreamDecoder::Status::Done) {
+        return -1;
+    }
+
+    std::cout << whole.log << std::endl;
+    if(bytes.substr(sd.consumed()) != "trailing" || whole.binary != blob) {
+        return -2;
+    }
+
+    // the same events for any split of the input
+    for(size_t step: {1, 2, 3, 7, 4096}) {
+        LogHandler pieces;
+        eipp::StreamDecoder decoder(&pieces);
+        auto status = eipp::StreamDecoder::Status::NeedMore;
+        for(size_t pos = 0; pos < bytes.size() && status == eipp::StreamDecoder::Status::NeedMore; pos += step) {
+            status = decoder.feed(bytes.data() + pos, std::min(step, bytes.size() - pos));
+        }
+
+        if(status != eipp::StreamDecoder::Status::Done || pieces.log != whole.log || pieces.binary != blob) {
+            return -2;
+        }
+    }
+
+    // integers bigger than a long are refused from their header on, not
+    // buffered whatever size they claim
+    const char large_big[] = {(char)131, (char)ERL_LARGE_BIG_EXT, 0x7f, (char)0xff, (char)0xff, (char)0xff, 0};
+    const char small_big[] = {(char)131, (char)ERL_SMALL_BIG_EXT, 9, 0};
+    for(size_t step: {1, 7}) {
+        LogHandler h1, h2;
+        eipp::StreamDecoder d1(&h1), d2(&h2);
+        auto s1 = eipp::StreamDecoder::Status::NeedMore, s2 = s1;
+        for(size_t pos = 0; pos < sizeof(large_big) && s1 == eipp::StreamDecoder::Status::NeedMore; pos += step) {
+            s1 = d1.feed(large_big + pos, std::min(step, sizeof(large_big) - pos));
+        }
+        for(size_t pos = 0; pos < sizeof(small_big) && s2 == eipp::StreamDecoder::Status::NeedMore; pos += step) {
+            s2 = d2.feed(small_big + pos, std::min(step, sizeof(small_big) - pos));
+        }
+        if(s1 != eipp::StreamDecoder::Status::Error || s2 != eipp::StreamDecoder::Status::Error) {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+int test_case11() {
+    std::cout << std::endl << "test case 11" << std::endl;
+
+    ContentLoader cl2("./test_data/case2");
+    ContentLoader cl3("./test_data/case3");
+    ContentLoader cl4("./test_data/case4");
+
+    eipp::TermCursor c2(cl2.get_buf());
+    double d = 0;
+    eipp::ByteView bin;
+    if(c2.type() != eipp::TYPE::Tuple || c2.arity() != 4 || !c2.child(3).get_double(d) || d != 1.23
+            || !c2.child(1).get_binary(bin) || bin != "v2binary" || c2.child(4).valid()) {
+        return -2;
+    }
+
+    eipp::TermCursor c3(cl3.get_buf());
+    std::cout << c3.child(2).child(0).atom() << std::endl;
+    if(c3.arity() != 5 || c3.child(2).child(0).atom() != "zoe") {
+        return -2;
+    }
+
+    // route on the map and decode one branch only
+    eipp::TermCursor c4(cl4.get_buf());
+    auto two = c4.find_map_key(2L);
+    eipp::ByteView name;
+    if(!two.valid() || !two.child(2).get_string(name) || name != "Two" || c4.find_map_key(9L).valid()) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder(two);
+    auto value = decoder.decode<std::tuple<long, long, std::string>>();
+    if(!decoder.is_valid() || std::get<1>(value) != 200) {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case12() {
+    std::cout << std::endl << "test case 12" << std::endl;
+
+    ContentLoader cl2("./test_data/case2");
+    ContentLoader cl4("./test_data/case4");
+
+    using T = eipp::Tuple<eipp::StringView, eipp::Skip, eipp::Skip, eipp::Double>;
+    eipp::EIDecoder decoder(cl2.get_buf());
+    auto result = decoder.parse<T>();
+    if(!decoder.is_valid() || result->get<0>() != "v1string" || result->get<3>() != 1.23) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder2(cl2.get_buf());
+    auto result2 = decoder2.decode<std::tuple<eipp::Skip, eipp::Skip, long, eipp::Skip>>();
+    if(!decoder2.is_valid() || std::get<2>(result2) != 222) {
+        return -2;
+    }
+
+    // paths
+    std::map<std::string, std::tuple<int, std::map<eipp::Atom, std::vector<long>>>> nested;
+    nested["a"] = std::make_tuple(1, std::map<eipp::Atom, std::vector<long>>{{eipp::Atom("key"), {10, 2000}}});
+
+    eipp::EIEncoder en;
+    en.encode(std::make_tuple(eipp::Atom("telemetry"), 1, 2, nested));
+    auto bytes = en.get_data();
+
+    long v = 0;
+    eipp::TermCursor term(bytes.data());
+    if(!term.at("3.a.1.key.1").get_long(v) || v != 2000 || term.at("3.b").valid() || term.at("9").valid()) {
+        return -2;
+    }
+
+    // 2^64 + 1 is no index, rather than wrapping around to 1
+    if(term.at("18446744073709551617").valid() || term.at("3.a.18446744073709551617").valid()) {
+        return -2;
+    }
+
+    eipp::ByteView three;
+    if(!eipp::TermCursor(cl4.get_buf()).at("3.2").get_string(three) || three != "Three") {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case13() {
+    std::cout << std::endl << "test case 13" << std::endl;
+
+    ContentLoader cl3("./test_data/case3");
+    ContentLoader cl4("./test_data/case4");
+
+    using T = eipp::Tuple<eipp::Long, eipp::Long, eipp::String>;
+    eipp::EIDecoder decoder(cl4.get_buf());
+    auto sorted = decoder.parse<eipp::Map<eipp::Long, T>>();
+    eipp::EIDecoder decoder2(cl4.get_buf());
+    auto hashed = decoder2.parse<eipp::Map<eipp::Long, T, eipp::HashMapStorage>>();
+    if(!decoder.is_valid() || !decoder2.is_valid() || sorted->size() != hashed->size()) {
+        return -1;
+    }
+
+    for(auto& iter: *sorted) {
+        auto found = hashed->find(iter.first);
+        if(found == hashed->end() || found->second->get<2>() != iter.second->get<2>()) {
+            return -2;
+        }
+    }
+    if(sorted->find(42) != sorted->end() || hashed->find(42) != hashed->end()) {
+        return -2;
+    }
+
+    // #{3 => 30, 1 => 10, 2 => 20} sent out of key order
+    const char unordered[] = {(char)131, 't', 0, 0, 0, 3,
+            'a', 3, 'a', 30, 'a', 1, 'a', 10, 'a', 2, 'a', 20};
+    eipp::EIDecoder decoder3(unordered);
+    auto m = decoder3.parse<eipp::Map<eipp::Long, eipp::Long>>();
+    if(!decoder3.is_valid() || m->begin()->first != 1 || m->find(3)->second != 30) {
+        return -2;
+    }
+
+    // lists are contiguous and random access
+    eipp::EIDecoder decoder4(cl3.get_buf());
+    auto list = decoder4.parse<eipp::List<eipp::Tuple<eipp::AtomView, eipp::Long>>>();
+    if(!decoder4.is_valid() || list->empty() || (*list)[list->size() - 1] != *(list->end() - 1)) {
+        return -2;
+    }
+
+    eipp::EIEncoder en;
+    en.encode(std::vector<std::string>{"x", "yy", "zzz"});
+    auto bytes = en.get_data();
+    eipp::EIDecoder decoder5(bytes.data());
+    auto strings = decoder5.parse<eipp::List<eipp::String>>();
+    if(!decoder5.is_valid() || strings->size() != 3 || (*strings)[2] != "zzz") {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case14() {
+    std::cout << std::endl << "test case 14" << std::endl;
+
+    // small, 32 bit, big and negative integers mixed in one list
+    std::vector<long> longs{1, 300, -5, 1L << 40, 7, 255, -2147483647 - 1};
+    std::vector<double> doubles{0.5, -1.25, 1e300};
+
+    eipp::EIEncoder en;
+    en.encode(std::make_tuple(longs, doubles));
+    auto bytes = en.get_data();
+
+    eipp::EIDecoder decoder(bytes.data());
+    auto result = decoder.parse<eipp::Tuple<eipp::List<eipp::Long>, eipp::List<eipp::Double>>>();
+    if(!decoder.is_valid()) {
+        return -1;
+    }
+    auto l = result->get<0>();
+    auto d = result->get<1>();
+    if(!std::equal(longs.begin(), longs.end(), l->begin()) || !std::equal(doubles.begin(), doubles.end(), d->begin())) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder2(bytes.data());
+    auto result2 = decoder2.decode<std::tuple<std::vector<int64_t>, std::vector<double>>>();
+    if(!decoder2.is_valid() || std::get<1>(result2) != doubles ||
+            !std::equal(longs.begin(), longs.end(), std::get<0>(result2).begin())) {
+        return -2;
+    }
+
+    // a value out of range for the element type still fails
+    eipp::EIDecoder decoder3(bytes.data());
+    decoder3.decode<std::tuple<std::vector<int32_t>, std::vector<double>>>();
+    if(decoder3.is_valid()) {
+        return -2;
+    }
+
+    // [1, 2, 200] as Erlang sends it: STRING_EXT
+    const char byte_list[] = {(char)131, 'k', 0, 3, 1, 2, (char)200};
+    eipp::EIDecoder decoder4(byte_list);
+    auto b = decoder4.parse<eipp::List<eipp::Long>>();
+    eipp::EIDecoder decoder5(byte_list);
+    auto u8 = decoder5.decode<std::vector<uint8_t>>();
+    eipp::EIDecoder decoder6(byte_list);
+    decoder6.decode<std::vector<int8_t>>();
+    if(!decoder4.is_valid() || b->size() != 3 || (*b)[2] != 200 ||
+            !decoder5.is_valid() || u8 != std::vector<uint8_t>{1, 2, 200} || decoder6.is_valid()) {
+        return -2;
+    }
+
+    // other sequences check the range the same way
+    eipp::EIDecoder decoder7(byte_list);
+    decoder7.decode<std::list<int8_t>>();
+    eipp::EIDecoder decoder8(byte_list);
+    decoder8.decode<std::deque<int8_t>>();
+    eipp::EIDecoder decoder9(byte_list);
+    auto u8_list = decoder9.decode<std::list<uint8_t>>();
+    if(decoder7.is_valid() || decoder8.is_valid() || !decoder9.is_valid() || u8_list != std::list<uint8_t>{1, 2, 200}) {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case15() {
+    std::cout << std::endl << "test case 15" << std::endl;
+
+    // small integers go out as a byte string, like Erlang sends them
+    std::vector<int> bytes{1, 2, 255};
+    eipp::EIEncoder en;
+    en.encode(bytes);
+    if(en.get_data() != std::string("\x83k\x00\x03\x01\x02\xff", 7) || eipp::encoded_size(bytes) != en.size()) {
+        return -2;
+    }
+
+    // numbers written inline must match ei byte for byte
+    std::vector<long> longs{0, 255, 256, -1, ERL_MAX, ERL_MAX + 1L, ERL_MIN, ERL_MIN - 1L, 1L << 40, -(1L << 40)};
+    std::vector<double> doubles{0.0, -2.5, 1e-300};
+
+    int size = 0;
+    std::string expected(1024, '\0');
+    ei_encode_version(&expected[0], &size);
+    ei_encode_tuple_header(&expected[0], &size, 2);
+    ei_encode_list_header(&expected[0], &size, (int)longs.size());
+    for(long v: longs) ei_encode_long(&expected[0], &size, v);
+    ei_encode_empty_list(&expected[0], &size);
+    ei_encode_list_header(&expected[0], &size, (int)doubles.size());
+    for(double v: doubles) ei_encode_double(&expected[0], &size, v);
+    ei_encode_empty_list(&expected[0], &size);
+    expected.resize((size_t)size);
+
+    eipp::EIEncoder en2;
+    auto numbers = std::make_tuple(longs, doubles);
+    en2.encode(numbers);
+    if(en2.get_data() != expected || eipp::encoded_size(numbers) != expected.size()) {
+        return -2;
+    }
+
+    // too long for a byte string
+    std::vector<unsigned char> many(70000, 7);
+    eipp::EIEncoder en3;
+    en3.encode(many);
+    auto data3 = en3.get_data();
+    eipp::EIDecoder decoder3(data3.data());
+    if(data3[1] != ERL_LIST_EXT || decoder3.decode<std::vector<unsigned char>>() != many || eipp::encoded_size(many) != data3.size()) {
+        return -2;
+    }
+
+    // raw little-endian binary
+    std::vector<double> samples{1.5, -3.25, 1e10};
+    eipp::EIEncoder en4;
+    en4.encode(eipp::raw_array(samples));
+    auto data4 = en4.get_data();
+    eipp::ByteView payload;
+    if(!eipp::TermCursor(data4.data()).get_binary(payload) || payload.size() != 24 ||
+            eipp::encoded_size(eipp::raw_array(samples)) != data4.size()) {
+        return -2;
+    }
+    for(size_t i = 0; i < samples.size(); i++) {
+        uint64_t bits = 0;
+        for(int b = 7; b >= 0; b--) bits = (bits << 8) | (unsigned char)payload[i * 8 + b];
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+        if(v != samples[i]) return -2;
+    }
+
+    return 0;
+}
+
+enum KnownAtom: uint32_t {
+    atom_ok, atom_error, atom_reply,
+};
+
+int test_case16() {
+    std::cout << std::endl << "test case 16" << std::endl;
+
+    eipp::AtomTable table{"ok", "error", "reply"};
+    if(table.find("error") != atom_error || table.find("nope").valid() || table.name(atom_reply) != "reply") {
+        return -2;
+    }
+
+    // pre-encoded atoms give the same bytes as eipp::Atom
+    auto reply = std::make_tuple(table.encoded(atom_ok), 42, table.encoded(table.intern("extra")));
+    eipp::EIEncoder en;
+    en.encode(reply);
+    eipp::EIEncoder en2;
+    en2.encode(std::make_tuple(eipp::Atom("ok"), 42, eipp::Atom("extra")));
+    auto data = en.get_data();
+    if(data != en2.get_data() || eipp::encoded_size(reply) != data.size()) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder(data.data());
+    decoder.set_atom_table(&table);
+    auto result = decoder.decode<std::tuple<eipp::AtomId, long, eipp::AtomId>>();
+    if(!decoder.is_valid() || std::get<0>(result) != atom_ok || std::get<1>(result) != 42 ||
+            table.name(std::get<2>(result)) != "extra") {
+        return -2;
+    }
+
+    // unknown atoms are not an error, a missing table is
+    eipp::AtomTable small{"error"};
+    eipp::EIDecoder decoder2(data.data());
+    decoder2.set_atom_table(&small);
+    auto result2 = decoder2.decode<std::tuple<eipp::AtomId, long, eipp::Skip>>();
+    eipp::EIDecoder decoder3(data.data());
+    decoder3.decode<std::tuple<eipp::AtomId, long, eipp::Skip>>();
+    if(!decoder2.is_valid() || std::get<0>(result2).valid() || decoder3.is_valid()) {
+        return -2;
+    }
+
+    eipp::TermCursor term(data.data());
+    if(term.child(0).atom_id(table) != atom_ok || term.child(1).atom_id(table).valid()) {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case17() {
+    std::cout << std::endl << "test case 17" << std::endl;
+
+#ifdef EIPP_WITH_ZLIB
+    typedef std::tuple<long, std::vector<std::string>, std::vector<double>> T;
+    T value(7, std::vector<std::string>(200, "the same line again"), std::vector<double>(100, 0.5));
+
+    eipp::EIEncoder en;
+    en.set_compression(256, 6);
+    en.encode(value);
+    auto data = en.get_data();
+    if(data[1] != 80 || data.size() >= eipp::encoded_size(value)) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder(data.data(), data.size());
+    if(!decoder.is_valid() || decoder.decode<T>() != value) {
+        return -2;
+    }
+
+    // the size is needed to read a zlib stream
+    eipp::EIDecoder decoder2(data.data());
+    if(decoder2.is_valid()) {
+        return -2;
+    }
+
+    // views point into the inflated copy, which lives in the Arena
+    eipp::Arena arena;
+    eipp::EIDecoder decoder3(data.data(), data.size(), &arena);
+    auto result = decoder3.parse<eipp::Tuple<eipp::Long, eipp::List<eipp::StringView>, eipp::Skip>>();
+    if(!decoder3.is_valid() || result->get<0>() != 7 || (*result->get<1>())[199] != "the same line again") {
+        return -2;
+    }
+
+    // below the threshold nothing changes
+    eipp::EIEncoder en2;
+    en2.set_compression(256);
+    en2.encode(std::make_tuple(1, 2));
+    if(en2.get_data()[1] == 80 || !en2.is_valid()) {
+        return -2;
+    }
+
+    // an uncompressed size deflate cannot reach is refused before allocating
+    std::string forged = data.substr(0, 10);
+    forged[2] = forged[3] = forged[4] = forged[5] = (char)0xff;
+    eipp::Arena arena2;
+    eipp::EIDecoder decoder4(forged.data(), forged.size(), &arena2);
+    if(decoder4.is_valid() || arena2.capacity() > (1 << 20)) {
+        return -2;
+    }
+
+    // caller memory, compressed in place
+    std::vector<char> buf(eipp::encoded_size(value));
+    eipp::EIEncoder en3(buf.data(), buf.size());
+    en3.set_compression(1);
+    en3.encode(value);
+    en3.finish();
+    if(std::string(en3.data(), en3.size()) != data) {
+        return -2;
+    }
+
+    // with referenced binaries caller memory holds only part of the term:
+    // compressed output that does not fit it is not written there
+    std::string payload(1 << 20, 'z');
+    auto big = std::make_tuple(eipp::Binary(payload), 7);
+    for(size_t capacity: {64, 8192}) {
+        std::vector<char> small(capacity);
+        eipp::EIEncoder en4(small.data(), small.size());
+        en4.set_reference_threshold(1024);
+        en4.set_compression(1);
+        en4.encode(big);
+        en4.finish();
+
+        std::string out;
+        for(auto& iov: en4.get_iovecs()) {
+            out.append((const char*)iov.iov_base, iov.iov_len);
+        }
+        eipp::EIDecoder decoder4(out.data(), out.size());
+        auto decoded = decoder4.decode<std::tuple<eipp::Binary, long>>();
+        if(!en4.is_valid() || (out[1] == 80) != (capacity == 8192) || !decoder4.is_valid() ||
+                std::get<0>(decoded).get_value() != payload || std::get<1>(decoded) != 7) {
+            return -2;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef EIPP_POSIX
+// a PortServer between two pipes standing in for the Erlang VM
+int serve_over_pipes(size_t workers) {
+    int to_server[2], from_server[2];
+    if(pipe(to_server) != 0 || pipe(from_server) != 0) {
+        return -1;
+    }
+
+    const size_t count = 300;
+    std::thread client([&]() {
+        for(size_t i = 0; i < count; i++) {
+            eipp::EIEncoder en;
+            std::string data;
+            if(i % 10 == 1) {
+                data = i % 20 == 1 ? std::string() : std::string(1, (char)131);  // too short to be a term
+            } else if(i % 50 == 7) {
+                en.encode(std::make_tuple(eipp::Atom("size"), eipp::Binary(std::string(100000 + i, 'x'))));
+            } else if(i % 10 == 3) {
+                en.encode(std::make_tuple(eipp::Atom("silent")));
+            } else if(i % 10 == 5) {
+                en.encode(std::make_tuple(eipp::Atom("nope"), (long)i));
+            } else if(i % 10 == 9) {
+                en.encode(std::make_tuple(eipp::Atom("overflow")));
+            } else {
+                en.encode(std::make_tuple(eipp::Atom("add"), (long)i, 1000L));
+            }
+
+            if(i % 10 != 1) data = en.get_data();
+            char header[4];
+            eipp::detail::put_be32(header, (uint32_t)data.size());
+            if(write(to_server[1], header, 4) != 4 || write(to_server[1], data.data(), data.size()) != (ssize_t)data.size()) {
+                break;
+            }
+        }
+        close(to_server[1]);
+    });
+
+    eipp::PortServer server(4, to_server[0], from_server[1]);
+    server.set_workers(workers);
+    server.on("add", [](const eipp::TermCursor& request, eipp::EIEncoder& reply) {
+        long a = 0, b = 0;
+        request.child(1).get_long(a);
+        request.child(2).get_long(b);
+        reply.encode(std::make_tuple(eipp::Atom("ok"), a + b));
+    });
+    server.on("size", [](const eipp::TermCursor& request, eipp::EIEncoder& reply) {
+        eipp::ByteView payload;
+        request.child(1).get_binary(payload);
+        reply.encode(std::make_tuple(eipp::Atom("ok"), (long)payload.size()));
+    });
+    server.on("silent", [](const eipp::TermCursor&, eipp::EIEncoder&) {
+    });
+    server.on("overflow", [](const eipp::TermCursor&, eipp::EIEncoder& reply) {
+        static thread_local char small[8];
+        reply = eipp::EIEncoder(small, sizeof(small));
+        reply.encode(std::string(100, 'x'));
+    });
+    server.on_other([](const eipp::TermCursor& request, eipp::EIEncoder& reply) {
+        reply.encode(std::make_tuple(eipp::Atom("error"), eipp::Atom(request.child(0).atom().to_string())));
+    });
+
+    int ret = server.run();
+    client.join();
+    close(to_server[0]);
+    close(from_server[1]);
+    if(ret != 0) {
+        close(from_server[0]);
+        return -1;
+    }
+
+    std::string out;
+    char chunk[4096];
+    ssize_t n;
+    while((n = read(from_server[0], chunk, sizeof(chunk))) > 0) {
+        out.append(chunk, (size_t)n);
+    }
+    close(from_server[0]);
+
+    // one reply per request but the silent ones, in request order
+    size_t pos = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(i % 10 == 3 && i % 50 != 7) continue;
+        if(pos + 4 > out.size()) return -2;
+
+        size_t size = eipp::detail::get_be32(out.data() + pos);
+        eipp::EIDecoder decoder(out.data() + pos + 4);
+        pos += 4 + size;
+
+        auto reply = decoder.decode<std::tuple<eipp::AtomView, eipp::Skip>>();
+        eipp::TermCursor value = eipp::TermCursor(out.data() + pos - size).child(1);
+        long v = 0;
+        if(!decoder.is_valid()) return -2;
+        if(i % 50 == 7) {
+            if(!value.get_long(v) || v != 100000 + (long)i) return -2;
+        } else if(i % 10 == 1 || i % 10 == 9) {
+            // still answered, so the caller does not wait forever
+            if(std::get<0>(reply).get_value() != "error" || value.atom() != (i % 10 == 1 ? "bad_request" : "encode_failed")) {
+                return -2;
+            }
+        } else if(i % 10 == 5) {
+            if(std::get<0>(reply).get_value() != "error" || value.atom() != "nope") return -2;
+        } else if(!value.get_long(v) || v != (long)i + 1000) {
+            return -2;
+        }
+    }
+
+    return pos == out.size() ? 0 : -2;
+}
+#endif
+
+int test_case18() {
+    std::cout << std::endl << "test case 18" << std::endl;
+
+#ifdef EIPP_POSIX
+    for(size_t workers: {0, 3}) {
+        int ret = serve_over_pipes(workers);
+        if(ret != 0) return ret;
+    }
+#endif
+
+    return 0;
+}
+
+int test_case19() {
+    std::cout << std::endl << "test case 19" << std::endl;
+
+    auto value = std::make_tuple(eipp::Atom("ok"), std::vector<double>(100, 1.5));
+
+    // reset keeps the buffer
+    eipp::EIEncoder en;
+    en.encode(value);
+    auto first = en.get_data();
+    const char* buffer = en.data();
+    size_t capacity = en.capacity();
+
+    en.reset();
+    en.encode(value);
+    if(en.get_data() != first || en.data() != buffer || en.capacity() != capacity) {
+        return -2;
+    }
+
+    // moving hands the buffer over
+    eipp::EIEncoder moved(std::move(en));
+    if(moved.data() != buffer || moved.get_data() != first || en.size() != 1 || en.capacity() != 0) {
+        return -2;
+    }
+    en.encode(value);
+    if(en.get_data() != first) {
+        return -2;
+    }
+
+    std::vector<eipp::EIEncoder> encoders;
+    encoders.push_back(std::move(moved));
+    encoders.emplace_back();
+    encoders[1] = std::move(encoders[0]);
+    if(encoders[1].data() != buffer || encoders[1].get_data() != first) {
+        return -2;
+    }
+
+    // pooled encoders come back reset, with their buffer
+    eipp::EncoderPool pool(2);
+    const eipp::EIEncoder* pooled = nullptr;
+    {
+        auto handle = pool.acquire();
+        handle->encode(value);
+        pooled = &*handle;
+        buffer = handle->data();
+    }
+    {
+        auto handle = pool.acquire();
+        if(&*handle != pooled || handle->size() != 1 || pool.idle() != 0) {
+            return -2;
+        }
+        handle->encode(value);
+        if(handle->data() != buffer || handle->get_data() != first) {
+            return -2;
+        }
+    }
+
+    // too large to keep
+    eipp::EncoderPool small_pool(2, 64);
+    {
+        auto handle = small_pool.acquire();
+        handle->encode(value);
+    }
+    if(small_pool.idle() != 0) {
+        return -2;
+    }
+
+    eipp::EIEncoder& local = eipp::local_encoder();
+    local.encode(value);
+    buffer = local.data();
+    if(&eipp::local_encoder() != &local || local.size() != 1) {
+        return -2;
+    }
+    local.encode(value);
+    if(local.data() != buffer || local.get_data() != first) {
+        return -2;
+    }
+
+    return 0;
+}
+
+
+int test_case20() {
+    std::cout << std::endl << "test case 20" << std::endl;
+
+    // messages of very different sizes, so workers have to steal
+    std::vector<std::string> messages;
+    for(long i = 0; i < 500; i++) {
+        eipp::EIEncoder en;
+        en.encode(std::make_tuple(i, std::vector<long>(i % 7 == 0 ? 5000 : i % 3, i)));
+        messages.push_back(en.get_data());
+    }
+    messages.push_back("bad");
+
+    std::vector<eipp::ByteView> inputs;
+    for(auto& message: messages) {
+        inputs.emplace_back(message.data(), message.size());
+    }
+
+    typedef std::tuple<long, std::vector<long>> V;
+    std::vector<V> values;
+    if(eipp::decode_batch(inputs, values) != 1 || values.size() != inputs.size()) {
+        return -2;
+    }
+
+    // every type shares the one process wide pool
+    std::vector<std::tuple<int, std::list<long>>> other_type;
+    if(eipp::decode_batch(inputs, other_type) != 1 || std::get<1>(other_type[7]).size() != 5000 ||
+            &eipp::default_batch_decoder() != &eipp::default_batch_decoder()) {
+        return -2;
+    }
+    for(long i = 0; i < 500; i++) {
+        auto& list = std::get<1>(values[i]);
+        if(std::get<0>(values[i]) != i || list.size() != size_t(i % 7 == 0 ? 5000 : i % 3)) {
+            return -2;
+        }
+        for(long v: list) {
+            if(v != i) return -2;
+        }
+    }
+
+    // wrapper types live in the per-worker arenas until the next batch
+    using T = eipp::Tuple<eipp::Long, eipp::List<eipp::Long>>;
+    eipp::BatchDecoder batch(3);
+    std::vector<T*> results;
+    for(int round = 0; round < 3; round++) {
+        if(batch.parse(inputs, results) != 1 || results.back() != nullptr) {
+            return -2;
+        }
+        for(long i = 0; i < 500; i++) {
+            long first = results[i]->get<0>();
+            auto list = results[i]->get<1>();
+            if(first != i || list->size() != size_t(i % 7 == 0 ? 5000 : i % 3)) {
+                return -2;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+int test_case21() {
+    std::cout << std::endl << "test case 21" << std::endl;
+
+    std::string blob(8192, 'b');
+    std::vector<std::tuple<long, std::string, std::vector<long>, eipp::BinaryView>> rows;
+    std::map<long, std::string> names;
+    std::list<std::string> lines;
+    for(long i = 0; i < 20000; i++) {
+        eipp::ByteView payload(i % 1000 == 0 ? blob.data() : "small", i % 1000 == 0 ? blob.size() : 5);
+        rows.emplace_back(i, "row" + std::to_string(i), std::vector<long>(i % 5, i * 1000), eipp::BinaryView(payload));
+        names[i * 3] = std::to_string(i);
+        lines.push_back(std::to_string(i));
+    }
+    auto data = std::make_tuple(eipp::Atom("snapshot"), rows, names, lines);
+
+    eipp::EIEncoder serial;
+    serial.set_reference_threshold(4096);
+    serial.encode(data);
+    auto expected = serial.get_data();
+
+    eipp::EIEncoder en;
+    en.set_reference_threshold(4096);
+    en.set_threads(4, 1000);
+    en.encode(data);
+    if(!en.is_valid() || en.size() != expected.size() || en.get_data() != expected) {
+        return -2;
+    }
+
+    std::string gathered;
+    for(auto& iov: en.get_iovecs()) {
+        gathered.append((const char*)iov.iov_base, iov.iov_len);
+    }
+    if(gathered != expected || en.get_iovecs().size() != serial.get_iovecs().size()) {
+        return -2;
+    }
+
+    // still usable after reset and move, and it fails like the serial path
+    eipp::EIEncoder moved(std::move(en));
+    moved.reset();
+    moved.encode(data);
+    if(moved.get_data() != expected) {
+        return -2;
+    }
+
+    std::vector<char> mem(expected.size() - 1);
+    eipp::EIEncoder fixed(&mem[0], mem.size());
+    fixed.set_threads(3, 1000);
+    fixed.encode(data);
+    if(fixed.is_valid()) {
+        return -2;
+    }
+
+    return 0;
+}
 
-int main() {
-    // decode test
-    int ret;
-    std::vector<test_func_t> funcs{
-            test_case1, test_case2, test_case3, test_case4,
+
+int test_case22() {
+    std::cout << std::endl << "test case 22" << std::endl;
+
+    typedef std::tuple<long, std::vector<double>, std::string, std::map<long, long>> T;
+    T value(7, std::vector<double>{0.5, 1.5, 2.5}, "name", std::map<long, long>{{1, 10}, {2, 20}});
+
+    eipp::reset_stats();
+    std::vector<eipp::TermStats> terms;
+    eipp::set_stats_callback([&terms](const eipp::TermStats& term) {
+        terms.push_back(term);
+    });
+
+    eipp::EIEncoder en;
+    en.encode(value);
+    auto data = en.get_data();
+
+    eipp::EIDecoder decoder(data.data(), data.size());
+    decoder.decode<T>();
+
+    using W = eipp::Tuple<eipp::Long, eipp::List<eipp::Double>, eipp::String, eipp::Map<eipp::Long, eipp::Long>>;
+    std::thread other([&data]() {
+        eipp::EIDecoder decoder(data.data(), data.size());
+        decoder.parse<W>();
+    });
+    other.join();
+
+    eipp::set_stats_callback(nullptr);
+    auto stats = eipp::stats();
+
+#ifdef EIPP_ENABLE_STATS
+    using eipp::TYPE;
+    auto& nodes = stats.nodes_decoded;
+    if(nodes[(size_t)TYPE::Tuple] != 2 || nodes[(size_t)TYPE::Integer] != 10 || nodes[(size_t)TYPE::Float] != 6 ||
+            nodes[(size_t)TYPE::String] != 2 || nodes[(size_t)TYPE::List] != 2 || nodes[(size_t)TYPE::Map] != 2) {
+        return -2;
+    }
+    if(stats.terms_decoded != 2 || stats.bytes_decoded != 2 * (data.size() - 1) ||
+            stats.terms_encoded != 1 || stats.bytes_encoded != data.size() ||
+            stats.buffer_allocations == 0 || stats.arena_blocks == 0) {
+        return -2;
+    }
+
+    // the callback runs on whichever thread finished the term
+    if(terms.size() != 3 || !terms[0].encode || terms[0].bytes != data.size() || terms[1].encode || terms[2].encode) {
+        return -2;
+    }
+
+    eipp::reset_stats();
+    if(eipp::stats().terms_decoded != 0 || eipp::stats().nodes_decoded[(size_t)TYPE::Integer] != 0) {
+        return -2;
+    }
+#else
+    if(stats.terms_decoded != 0 || stats.terms_encoded != 0 || !terms.empty()) {
+        return -2;
+    }
+#endif
+
+    return 0;
+}
+
+
+int test_case23() {
+    std::cout << std::endl << "test case 23" << std::endl;
+
+    std::map<std::string, long> counts{{"a", 1}, {"b", 2}};
+    auto value = std::make_tuple(eipp::Atom("order"), eipp::Atom("a_rather_long_atom"), 42L, -1234567890123L, 2.5,
+            std::string("text"), eipp::Binary("bin"), std::vector<long>{1000, 2000, 3000}, std::vector<long>(),
+            counts, std::make_tuple(std::make_tuple(7L)));
+
+    eipp::EIEncoder en;
+    en.encode(value);
+    auto data = en.get_data();
+
+    eipp::Term term(data.data());
+    auto root = term.root();
+    if(!term.valid() || !root.is(eipp::TYPE::Tuple) || root.size() != 11) {
+        return -2;
+    }
+
+    // 1 root + 11 elements + 3 list elements + 4 map keys/values + 1 + 1 nested
+    std::cout << term.node_count() << " nodes" << std::endl;
+    if(term.node_count() != 21) {
+        return -2;
+    }
+
+    long l = 0;
+    double d = 0;
+    eipp::ByteView v;
+    if(root[0].atom() != "order" || root[1].atom() != "a_rather_long_atom" ||
+            !root[2].get_long(l) || l != 42 || !root[3].get_long(l) || l != -1234567890123L ||
+            !root[4].get_double(d) || d != 2.5 || root[4].get_long(l) ||
+            !root[5].get_string(v) || v != "text" || !root[6].get_binary(v) || v != "bin") {
+        return -2;
+    }
+
+    auto list = root[7];
+    if(!list.is(eipp::TYPE::List) || list.size() != 3 || !list[2].get_long(l) || l != 3000 || list[3].valid()) {
+        return -2;
+    }
+    if(!root[8].is(eipp::TYPE::List) || root[8].size() != 0 || !root[8].get_string(v) || !v.empty()) {
+        return -2;
+    }
+
+    auto map = root[9];
+    if(map.size() != 2 || !map.find("b").get_long(l) || l != 2 || map.find("c").valid() ||
+            !map.key(0).get_string(v) || v != "a") {
+        return -2;
+    }
+    if(!root[10][0][0].get_long(l) || l != 7 || root[10][1].valid() || root[12].valid() || root[0][0].valid()) {
+        return -2;
+    }
+
+    // typed decoding of any part
+    std::vector<long> numbers;
+    std::map<std::string, long> decoded_counts;
+    if(!list.decode_into(numbers) || numbers != std::vector<long>{1000, 2000, 3000} ||
+            !map.decode_into(decoded_counts) || decoded_counts != counts || root[2].decode_into(numbers)) {
+        return -2;
+    }
+
+    eipp::Arena arena;
+    auto nested = root[10].parse<eipp::Tuple<eipp::Tuple<eipp::Long>>>(arena);
+    if(nested == nullptr || nested->get<0>()->get<0>() != 7 || root[9].parse<eipp::Tuple<eipp::Long>>(arena) != nullptr) {
+        return -2;
+    }
+    if(root[7].cursor().index() != list.cursor().index() || !root[7].cursor().child(1).get_long(l) || l != 2000) {
+        return -2;
+    }
+
+    // reuse for another message, and reject what it cannot hold
+    eipp::EIEncoder en2;
+    en2.encode(std::make_tuple(eipp::Atom("ok")));
+    auto data2 = en2.get_data();
+    if(!term.decode(data2.data()) || term.node_count() != 2 || term.root()[0].atom() != "ok") {
+        return -2;
+    }
+
+    const char improper[] = {(char)131, ERL_LIST_EXT, 0, 0, 0, 1, ERL_SMALL_INTEGER_EXT, 1, ERL_SMALL_INTEGER_EXT, 2};
+    if(term.decode(improper) || term.valid() || term.root().valid()) {
+        return -2;
+    }
+
+    return 0;
+}
+
+
+namespace shop {
+    struct Item {
+        long sku;
+        std::string title;
+        std::vector<double> prices;
     };
+    EIPP_NAMED_RECORD(Item, item, sku, title, prices)
 
-    for(test_func_t func: funcs) {
-        ret = func();
-        if(ret == -1) {
-            std::cerr << "parse error!" << std::endl;
-            return -1;
-        } else if(ret == -2) {
-            std::cerr << "compare failure!" << std::endl;
+    struct Order {
+        long id;
+        eipp::Atom status;
+        std::vector<Item> items;
+        std::map<std::string, long> meta;
+    };
+    EIPP_MAP_STRUCT(Order, id, status, items, meta)
+
+    struct Point {
+        double x;
+        double y;
+    };
+    EIPP_RECORD(Point, x, y)
+}
+
+int test_case24() {
+    std::cout << std::endl << "test case 24" << std::endl;
+
+    shop::Order order;
+    order.id = 17;
+    order.status = eipp::Atom("paid");
+    order.items.push_back(shop::Item{1, "pen", {1.5, 1.25}});
+    order.items.push_back(shop::Item{2, "ink", {}});
+    order.meta["source"] = 3;
+
+    eipp::EIEncoder en;
+    en.encode(order);
+    auto data = en.get_data();
+
+    // the same bytes as the map and record tuples written by hand
+    {
+        int index = 0;
+        std::string expected(data.size(), '\0');
+        char* buf = &expected[0];
+        ei_encode_version(buf, &index);
+        ei_encode_map_header(buf, &index, 4);
+        ei_encode_atom(buf, &index, "id");
+        ei_encode_long(buf, &index, 17);
+        ei_encode_atom(buf, &index, "status");
+        ei_encode_atom(buf, &index, "paid");
+        ei_encode_atom(buf, &index, "items");
+        ei_encode_list_header(buf, &index, 2);
+        ei_encode_tuple_header(buf, &index, 4);
+        ei_encode_atom(buf, &index, "item");
+        ei_encode_long(buf, &index, 1);
+        ei_encode_string(buf, &index, "pen");
+        ei_encode_list_header(buf, &index, 2);
+        ei_encode_double(buf, &index, 1.5);
+        ei_encode_double(buf, &index, 1.25);
+        ei_encode_empty_list(buf, &index);
+        ei_encode_tuple_header(buf, &index, 4);
+        ei_encode_atom(buf, &index, "item");
+        ei_encode_long(buf, &index, 2);
+        ei_encode_string(buf, &index, "ink");
+        ei_encode_empty_list(buf, &index);
+        ei_encode_empty_list(buf, &index);
+        ei_encode_atom(buf, &index, "meta");
+        ei_encode_map_header(buf, &index, 1);
+        ei_encode_string(buf, &index, "source");
+        ei_encode_long(buf, &index, 3);
+        if((size_t)index != data.size() || expected != data || eipp::encoded_size(order) != data.size()) {
             return -2;
         }
     }
 
+    eipp::EIDecoder decoder(data.data(), data.size());
+    auto decoded = decoder.decode<shop::Order>();
+    if(!decoder.is_valid() || decoded.id != 17 || decoded.status.get_value() != "paid" || decoded.items.size() != 2 ||
+            decoded.items[0].title != "pen" || decoded.items[0].prices != std::vector<double>{1.5, 1.25} ||
+            decoded.items[1].sku != 2 || decoded.meta != order.meta) {
+        return -2;
+    }
 
-    // encode test
+    // keys in another order, an unknown key, a missing field
+    std::string reordered(64, '\0');
+    int index = 0;
+    char* buf = &reordered[0];
+    ei_encode_version(buf, &index);
+    ei_encode_map_header(buf, &index, 3);
+    ei_encode_atom(buf, &index, "status");
+    ei_encode_atom(buf, &index, "new");
+    ei_encode_atom(buf, &index, "extra");
+    ei_encode_tuple_header(buf, &index, 0);
+    ei_encode_atom(buf, &index, "id");
+    ei_encode_long(buf, &index, 99);
+    reordered.resize((size_t)index);
+
+    shop::Order partial;
+    partial.meta["kept"] = 1;
+    eipp::EIDecoder decoder2(reordered.data(), reordered.size());
+    decoder2.decode_into(partial);
+    if(!decoder2.is_valid() || partial.id != 99 || partial.status.get_value() != "new" || partial.meta.size() != 1) {
+        return -2;
+    }
+
+    // records check tag and arity
+    eipp::EIEncoder en3;
+    en3.encode(std::vector<shop::Point>{{1.0, 2.0}});
+    auto points = en3.get_data();
+    eipp::EIDecoder decoder3(points.data(), points.size());
+    auto decoded_points = decoder3.decode<std::vector<shop::Point>>();
+    if(!decoder3.is_valid() || decoded_points.size() != 1 || decoded_points[0].y != 2.0 ||
+            eipp::Term(points.data()).root()[0][0].atom() != "Point") {
+        return -2;
+    }
+
+    eipp::EIEncoder en4;
+    en4.encode(std::make_tuple(eipp::Atom("Point"), 1.0));
+    auto short_record = en4.get_data();
+    eipp::EIDecoder decoder4(short_record.data(), short_record.size());
+    decoder4.decode<shop::Point>();
+    eipp::EIDecoder decoder5(points.data(), points.size());
+    decoder5.decode<std::vector<shop::Item>>();
+    if(decoder4.is_valid() || decoder5.is_valid()) {
+        return -2;
+    }
+
+    return 0;
+}
+
+int test_case25() {
+    std::cout << std::endl << "test case 25" << std::endl;
+
+    // a list streamed in chunks decodes like the same list encoded at once
+    std::string out;
+    size_t flushes = 0;
+    eipp::StreamEncoder stream([&](const char* data, size_t size) {
+        out.append(data, size);
+        flushes++;
+        return true;
+    }, 7, 64);
+
+    long next = 0;
+    stream.tuple_header(3);
+    stream.encode(eipp::Atom("rows"));
+    stream.generate_list<std::tuple<long, std::string>>([&](std::tuple<long, std::string>& row) {
+        row = std::make_tuple(next, "row" + std::to_string(next));
+        return ++next <= 100;
+    });
+    std::vector<std::vector<long>> nested{{}, {1, 2, 3, 4, 5, 6, 7, 8}, {9}};
+    stream.begin_list();
+    for(auto& inner: nested) {
+        stream.encode_list(inner.begin(), inner.end());
+    }
+    stream.end_list();
+    if(!stream.finish() || flushes < 2 || stream.written() != out.size()) {
+        return -2;
+    }
+
+    typedef std::tuple<eipp::Atom, std::vector<std::tuple<long, std::string>>, std::vector<std::vector<long>>> Rows;
+    eipp::EIDecoder decoder(out.data(), out.size());
+    auto rows = decoder.decode<Rows>();
+    if(!decoder.is_valid() || std::get<0>(rows).get_value() != "rows" || std::get<1>(rows).size() != 100 ||
+            std::get<1>(rows)[99] != std::make_tuple(99L, std::string("row99")) || std::get<2>(rows) != nested) {
+        return -2;
+    }
+
+    std::list<long> values;
+    for(long i = 0; i < 20; i++) values.push_back(i * i);
+    std::string out2;
+    eipp::StreamEncoder stream2([&](const char* data, size_t size) {
+        out2.append(data, size);
+        return true;
+    }, 6, 0);
+    stream2.encode_list(values.begin(), values.end());
+    if(!stream2.finish()) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder2(out2.data(), out2.size());
+    auto longs = decoder2.parse<eipp::List<eipp::Long>>();
+    eipp::EIDecoder decoder3(out2.data(), out2.size());
+    if(!decoder2.is_valid() || longs->size() != 20 || (*longs)[19] != 361 ||
+            decoder3.decode<std::list<long>>() != values) {
+        return -2;
+    }
+
+    // a cursor reads past the first chunk, too
+    eipp::TermCursor chunked(out2.data());
+    long square = 0;
+    if(chunked.arity() != 20 || !chunked.child(6).get_long(square) || square != 36 ||
+            !chunked.child(19).get_long(square) || square != 361 || chunked.child(20).valid()) {
+        return -2;
+    }
+
+    eipp::ByteView row;
+    if(eipp::TermCursor(out.data()).child(1).arity() != 100 ||
+            !eipp::TermCursor(out.data()).at("1.99.1").get_string(row) || row != "row99") {
+        return -2;
+    }
+
+    // a list nested in a list goes out as it is produced, too
+    std::string out4;
+    eipp::StreamEncoder nested_stream([&](const char* data, size_t size) {
+        out4.append(data, size);
+        return true;
+    }, 100000, 256);
+    std::vector<std::vector<long>> expected_nested{std::vector<long>()};
+    nested_stream.begin_list();
+    nested_stream.begin_list();
+    long sum = 0;
+    for(long i = 1000; i < 3000; i++) {
+        nested_stream.encode(i);
+        expected_nested[0].push_back(i);
+        sum += i;
+    }
+    size_t before_end = out4.size();
+    nested_stream.end_list();
+    nested_stream.end_list();
+    if(!nested_stream.finish() || before_end < 9000) {
+        return -2;
+    }
+
+    eipp::EIDecoder decoder4(out4.data(), out4.size());
+    if(decoder4.decode<std::vector<std::vector<long>>>() != expected_nested || !decoder4.is_valid()) {
+        return -2;
+    }
+
+    // StreamDecoder sees one list for all the chunks
+    struct ListCounter: eipp::StreamHandler {
+        long sum = 0;
+        int lists = 0, ends = 0;
+        void on_integer(long v) override { sum += v; }
+        void on_list_begin(size_t) override { lists++; }
+        void on_end() override { ends++; }
+    } counter;
+    eipp::StreamDecoder stream_decoder(&counter);
+    for(size_t pos = 0; pos < out4.size(); pos += 100) {
+        stream_decoder.feed(out4.data() + pos, std::min((size_t)100, out4.size() - pos));
+    }
+    if(stream_decoder.status() != eipp::StreamDecoder::Status::Done || counter.sum != sum ||
+            counter.lists != 2 || counter.ends != 2 || eipp::Term(out4.data()).valid()) {
+        return -2;
+    }
+
+    // an empty list is a plain nil, open containers and a failing sink fail
     eipp::EIEncoder en;
+    en.encode(std::vector<long>());
+    std::string out3;
+    eipp::StreamEncoder stream3([&](const char* data, size_t size) {
+        out3.append(data, size);
+        return true;
+    });
+    stream3.encode_list(values.end(), values.end());
+    if(!stream3.finish() || out3 != en.get_data()) {
+        return -2;
+    }
 
-    typedef std::tuple<int, std::string, std::list<eipp::Atom>> Person_t;
-    typedef std::map<eipp::Binary, std::list<int>> T1;
+    eipp::StreamEncoder stream4([](const char*, size_t) { return true; });
+    stream4.map_header(1);
+    stream4.encode(1L);
+    eipp::StreamEncoder stream5([](const char*, size_t) { return false; }, 4, 8);
+    stream5.encode_list(values.begin(), values.end());
+    if(stream4.finish() || stream5.finish()) {
+        return -2;
+    }
+
+    return 0;
+}
+
+
+int test_case26() {
+    std::cout << std::endl << "test case 26" << std::endl;
+
+#ifdef EIPP_POSIX
+    std::vector<std::tuple<long, std::string, eipp::BinaryView>> rows;
+    std::string blob(100000, 'm');
+    for(long i = 0; i < 5000; i++) {
+        rows.emplace_back(i, "row" + std::to_string(i), eipp::BinaryView(eipp::ByteView(blob.data(), (size_t)(i % 100))));
+    }
+    eipp::EIEncoder en;
+    en.encode(std::make_tuple(eipp::Atom("snapshot"), rows));
+    auto bytes = en.get_data();
+
+    char path[] = "/tmp/eipp_mappedXXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0 || write(fd, bytes.data(), bytes.size()) != (ssize_t)bytes.size()) {
+        return -1;
+    }
+    close(fd);
+
+    // decoded straight from the mapping, views point into it
+    eipp::MappedTermFile file(path);
+    unlink(path);       // the mapping outlives the name
+    if(!file.is_valid() || file.size() != bytes.size() || file.compressed()) {
+        return -2;
+    }
+    {
+        eipp::EIDecoder decoder(file.data(), file.size());
+        auto decoded = decoder.decode<std::tuple<eipp::AtomView, std::vector<std::tuple<long, std::string, eipp::BinaryView>>>>();
+        auto& last = std::get<1>(decoded).back();
+        if(!decoder.is_valid() || std::get<1>(decoded).size() != rows.size() || std::get<1>(last) != "row4999" ||
+                std::get<2>(last).get_value().size() != 99 ||
+                std::get<2>(last).get_value().data() < file.data() ||
+                std::get<2>(last).get_value().data() >= file.data() + file.size()) {
+            return -2;
+        }
+    }
+
+    file.advise(eipp::MappedTermFile::Access::Random);
+    auto row = file.cursor().child(1).child(1234);
+    long id = 0;
+    if(!row.child(0).get_long(id) || id != 1234) {
+        return -2;
+    }
+
+    file.release();
+    eipp::MappedTermFile moved(std::move(file));
+    eipp::EIDecoder decoder2(moved.data(), moved.size());
+    auto copied = decoder2.decode<std::tuple<eipp::Atom, std::vector<std::tuple<long, std::string, eipp::Binary>>>>();
+    if(file.is_valid() || !decoder2.is_valid() || std::get<1>(copied).size() != rows.size() ||
+            std::get<2>(std::get<1>(copied)[42]).get_value() != std::string(42, 'm')) {
+        return -2;
+    }
+
+    // ei indexes terms with an int: a file over 2 GiB is refused, and so is
+    // a binary whose length would take the index past INT_MAX
+    char big_path[] = "/tmp/eipp_mappedXXXXXX";
+    int big_fd = mkstemp(big_path);
+    if(big_fd < 0 || write(big_fd, bytes.data(), 16) != 16 || ftruncate(big_fd, (off_t)2200 << 20) != 0) {
+        return -1;
+    }
+    close(big_fd);
+    eipp::MappedTermFile big(big_path);
+    unlink(big_path);
+
+    const char huge_binary[] = {(char)131, 104, 2, 109, 0x7f, (char)0xff, (char)0xff, (char)0xfc, 97, 7};
+    eipp::EIDecoder decoder3(huge_binary, sizeof(huge_binary));
+    decoder3.decode<std::tuple<eipp::BinaryView, long>>();
+    eipp::EIDecoder decoder4(huge_binary, (size_t)std::numeric_limits<int>::max() + 1);
+    if(big.is_valid() || big.error() != EFBIG || decoder3.is_valid() || decoder4.is_valid()) {
+        return -2;
+    }
+
+    // no file, and a file that holds no term
+    eipp::MappedTermFile missing(path);
+    eipp::MappedTermFile not_term("./test.cpp");
+    if(missing.is_valid() || missing.error() != ENOENT || not_term.is_valid() || not_term.error() != EINVAL ||
+            not_term.cursor().valid()) {
+        return -2;
+    }
+#endif
+
+    return 0;
+}
+
+
+int test_case27() {
+    std::cout << std::endl << "test case 27" << std::endl;
+
+    // status updates of the same shape, decoded into the same objects
+    typedef std::tuple<eipp::Atom, std::string, std::vector<std::tuple<long, std::string>>, std::map<std::string, std::string>> Update;
+    std::vector<std::string> messages;
+    for(long i = 100; i < 1000; i++) {
+        std::string tail(40, (char)('a' + i % 26));
+        eipp::EIEncoder en;
+        en.encode(std::make_tuple(eipp::Atom("status"), "node" + std::to_string(i) + tail,
+                std::vector<std::tuple<long, std::string>>{std::make_tuple(i, "cpu" + tail), std::make_tuple(i * 2, "mem" + tail)},
+                std::map<std::string, std::string>{{"state", "up" + tail}, {"zone", "z" + std::to_string(i) + tail}}));
+        messages.push_back(en.get_data());
+    }
+
+    Update update;
+    const char* name = nullptr;
+    const std::tuple<long, std::string>* samples = nullptr;
+    const std::string* zone = nullptr;
+    const char* zone_data = nullptr;
+    for(size_t i = 0; i < messages.size(); i++) {
+        eipp::EIDecoder decoder(messages[i].data());
+        decoder.decode_into(update);
+        if(!decoder.is_valid()) {
+            return -1;
+        }
+
+        // strings, vectors and map nodes are those of the first message
+        auto& zone_now = std::get<3>(update)["zone"];
+        if(i == 0) {
+            name = std::get<1>(update).data();
+            samples = std::get<2>(update).data();
+            zone = &zone_now;
+            zone_data = zone_now.data();
+        } else if(std::get<1>(update).data() != name || std::get<2>(update).data() != samples ||
+                &zone_now != zone || zone_now.data() != zone_data) {
+            return -2;
+        }
+    }
+    std::string tail(40, (char)('a' + 999 % 26));
+    if(std::get<1>(update) != "node999" + tail || std::get<2>(update)[1] != std::make_tuple(1998L, "mem" + tail) ||
+            std::get<3>(update).size() != 2 || std::get<3>(update)["zone"] != "z999" + tail) {
+        return -2;
+    }
+
+    // a map with other keys replaces the old one
+    eipp::EIEncoder en;
+    en.encode(std::map<std::string, std::string>{{"state", "down"}, {"reason", "timeout"}});
+    auto other = en.get_data();
+    eipp::EIDecoder decoder(other.data());
+    decoder.decode_into(std::get<3>(update));
+    if(!decoder.is_valid() || std::get<3>(update) != std::map<std::string, std::string>{{"state", "down"}, {"reason", "timeout"}}) {
+        return -2;
+    }
+
+    // a wrapper tree decoded again in place stops taking memory from its Arena
+    typedef eipp::Tuple<eipp::Atom, eipp::String, eipp::List<eipp::Tuple<eipp::Long, eipp::String>>,
+            eipp::Map<eipp::String, eipp::String>> T1;
+    eipp::Arena arena;
+    eipp::EIDecoder first(messages[0].data(), &arena);
+    T1* tree = first.parse<T1>();
+    auto samples_node = tree->get<2>();
+    size_t capacity = arena.capacity();
+    for(size_t i = 1; i < messages.size(); i++) {
+        eipp::EIDecoder decoder(messages[i].data(), &arena);
+        decoder.decode_into(*tree);
+        if(!decoder.is_valid()) {
+            return -1;
+        }
+    }
+    if(arena.capacity() != capacity || tree->get<2>() != samples_node || tree->get<1>() != "node999" + tail ||
+            (*samples_node)[1]->get<0>() != 1998 || tree->get<3>()->find("zone")->second != "z999" + tail) {
+        return -2;
+    }
+
+    // messages of varying length keep the nodes the longest one needed
+    typedef eipp::Tuple<eipp::List<eipp::Tuple<eipp::Long, eipp::String>>, eipp::Map<eipp::Long, eipp::Tuple<eipp::Long>>,
+            eipp::Map<eipp::Long, eipp::String, eipp::HashMapStorage>> T2;
+    std::vector<std::string> varying;
+    for(long n: {100, 50, 0, 75}) {
+        std::vector<std::tuple<long, std::string>> rows;
+        std::map<long, std::tuple<long>> sorted;
+        std::map<long, std::string> hashed;
+        for(long i = 0; i < n; i++) {
+            rows.emplace_back(i + n, "row" + std::to_string(i) + tail);
+            sorted[i * n] = std::make_tuple(i);
+            hashed[i] = std::to_string(n) + tail;
+        }
+        eipp::EIEncoder en2;
+        en2.encode(std::make_tuple(rows, sorted, hashed));
+        varying.push_back(en2.get_data());
+    }
+
+    eipp::Arena arena2;
+    eipp::EIDecoder first2(varying[0].data(), &arena2);
+    T2* tree2 = first2.parse<T2>();
+    size_t capacity2 = arena2.capacity();
+    for(size_t i = 1; i < 2000; i++) {
+        size_t k = i % varying.size();
+        eipp::EIDecoder decoder(varying[k].data(), &arena2);
+        decoder.decode_into(*tree2);
+
+        long n = k == 0 ? 100 : k == 1 ? 50 : k == 2 ? 0 : 75;
+        auto rows = tree2->get<0>();
+        auto sorted = tree2->get<1>();
+        auto hashed = tree2->get<2>();
+        if(!decoder.is_valid() || rows->size() != (size_t)n || sorted->size() != (size_t)n || hashed->size() != (size_t)n) {
+            return -2;
+        }
+        // spares are out of sight
+        if(hashed->find(n) != hashed->end() || (n != 100 && sorted->find(99 * 100) != sorted->end())) {
+            return -2;
+        }
+        if(n > 0 && ((*rows)[n - 1]->get<0>() != 2 * n - 1 || sorted->find((n - 1) * n)->second->get<0>() != n - 1 ||
+                hashed->find(n - 1)->second != std::to_string(n) + tail)) {
+            return -2;
+        }
+    }
+    if(arena2.capacity() != capacity2) {
+        return -2;
+    }
+
+    return 0;
+}
 
-    std::tuple<std::string, int, Person_t, std::vector<Person_t>, T1> data;
+// the term of the encode example in README.md
+typedef std::tuple<int, std::string, std::list<eipp::Atom>> ReadmePerson;
+typedef std::tuple<std::string, int, ReadmePerson, std::vector<ReadmePerson>, std::map<eipp::Binary, std::list<int>>> ReadmeData;
+
+ReadmeData readme_data() {
+    ReadmeData data;
 
     std::get<0>(data) = "Hello World!";
     std::get<1>(data) = 101;
@@ -192,7 +1857,7 @@ int main() {
     auto p = std::make_tuple(1, "Jim", std::list<eipp::Atom>{eipp::Atom("j1"), eipp::Atom("j2")});
     std::get<2>(data) = p;
 
-    Person_t lp1;
+    ReadmePerson lp1;
     std::get<0>(lp1) = 2;
     std::get<1>(lp1) = "Tom";
     std::get<2>(lp1).push_back(eipp::Atom("t1"));
@@ -202,7 +1867,7 @@ int main() {
     std::get<3>(data).push_back(lp1);
 
 
-    Person_t lp2;
+    ReadmePerson lp2;
     std::get<0>(lp2) = 3;
     std::get<1>(lp2) = "David";
     std::get<2>(lp2).push_back(eipp::Atom("d1"));
@@ -215,6 +1880,88 @@ int main() {
     std::get<4>(data).insert(std::make_pair(eipp::Binary("binary 2"), std::list<int>{4,5,6}));
     std::get<4>(data).insert(std::make_pair(eipp::Binary("binary 3"), std::list<int>{7,8,9}));
 
+    return data;
+}
+
+int test_case28() {
+    std::cout << std::endl << "test case 28" << std::endl;
+
+    // the README example, byte for byte as term_to_binary writes it
+    const unsigned char readme[] = {
+            131, 104, 5,
+            107, 0, 12, 'H', 'e', 'l', 'l', 'o', ' ', 'W', 'o', 'r', 'l', 'd', '!',
+            97, 101,
+            104, 3, 97, 1, 107, 0, 3, 'J', 'i', 'm',
+                108, 0, 0, 0, 2, 119, 2, 'j', '1', 119, 2, 'j', '2', 106,
+            108, 0, 0, 0, 2,
+                104, 3, 97, 2, 107, 0, 3, 'T', 'o', 'm',
+                    108, 0, 0, 0, 3, 119, 2, 't', '1', 119, 2, 't', '2', 119, 2, 't', '3', 106,
+                104, 3, 97, 3, 107, 0, 5, 'D', 'a', 'v', 'i', 'd',
+                    108, 0, 0, 0, 3, 119, 2, 'd', '1', 119, 2, 'd', '2', 119, 2, 'd', '3', 106,
+                106,
+            116, 0, 0, 0, 3,
+                109, 0, 0, 0, 8, 'b', 'i', 'n', 'a', 'r', 'y', ' ', '1', 107, 0, 3, 1, 2, 3,
+                109, 0, 0, 0, 8, 'b', 'i', 'n', 'a', 'r', 'y', ' ', '2', 107, 0, 3, 4, 5, 6,
+                109, 0, 0, 0, 8, 'b', 'i', 'n', 'a', 'r', 'y', ' ', '3', 107, 0, 3, 7, 8, 9,
+    };
+    eipp::EIEncoder en;
+    en.encode(readme_data());
+    if(en.get_data() != std::string((const char*)readme, sizeof(readme))) {
+        return -2;
+    }
+
+    // {ok, [#{1 => {2.5, "x"}}, #{}], -1, 300, 1 bsl 40, []}
+    const unsigned char nested[] = {
+            131, 104, 6,
+            119, 2, 'o', 'k',
+            108, 0, 0, 0, 2,
+                116, 0, 0, 0, 1, 97, 1, 104, 2, 70, 0x40, 0x04, 0, 0, 0, 0, 0, 0, 107, 0, 1, 'x',
+                116, 0, 0, 0, 0,
+                106,
+            98, 0xff, 0xff, 0xff, 0xff,
+            98, 0, 0, 1, 44,
+            110, 6, 0, 0, 0, 0, 0, 0, 1,
+            106,
+    };
+    typedef std::tuple<eipp::Atom, std::vector<std::map<long, std::tuple<double, std::string>>>, long, long, long, std::vector<long>> Nested;
+    Nested term(eipp::Atom("ok"), {{{1, std::make_tuple(2.5, std::string("x"))}}, {}}, -1, 300, 1L << 40, {});
+    eipp::EIEncoder en2;
+    en2.encode(term);
+    if(en2.get_data() != std::string((const char*)nested, sizeof(nested))) {
+        return -2;
+    }
+
+    return 0;
+}
+
+
+typedef int(*test_func_t)();
+
+int main() {
+    // decode test
+    int ret;
+    std::vector<test_func_t> funcs{
+            test_case1, test_case2, test_case3, test_case4, test_case5, test_case6, test_case7, test_case8, test_case9, test_case10, test_case11, test_case12,
+            test_case13, test_case14, test_case15, test_case16, test_case17,
+            test_case18, test_case19, test_case20, test_case21, test_case22, test_case23, test_case24, test_case25, test_case26, test_case27, test_case28,
+    };
+
+    for(test_func_t func: funcs) {
+        ret = func();
+        if(ret == -1) {
+            std::cerr << "parse error!" << std::endl;
+            return -1;
+        } else if(ret == -2) {
+            std::cerr << "compare failure!" << std::endl;
+            return -2;
+        }
+    }
+
+
+    // encode test
+    eipp::EIEncoder en;
+
+    auto data = readme_data();
     en.encode(data);
 
     std::cout << "encode done" << std::endl;